@@ -0,0 +1,1336 @@
+// Per-group aggregates and the hashmap that collects them
+// shared by analyze and brc-merge, which only differ in where
+// the aggregates come from (raw text or partial aggregate files)
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Initial size of the per-thread key arena
+// it grows as needed, so keys can be of any length
+#define KEY_ARENA_SIZE ((1 << 10) * 16)
+
+// Initial capacity of each thread's hashmap
+// Needs to be a power of 2 (and at least PROBE_WIDTH)
+// so we can bit-and instead of modulo
+#define HASHMAP_INITIAL_CAPACITY 1024
+
+// Number of groups a hashmap of the given capacity holds before it grows
+// (a load factor of 7/8, so there is always an empty slot to stop probing)
+#define HASHMAP_MAX_GROUPS(capacity) ((capacity) / 8 * 7)
+
+// Groups (and keys) a hashmap of the given capacity has room for: the
+// HASHMAP_MAX_GROUPS it holds, and a spare one after them (see hashmap_entry)
+#define HASHMAP_GROUP_ROOM(capacity) (HASHMAP_MAX_GROUPS(capacity) + 1)
+
+// The hashmap is probed this many slots at a time
+// by comparing their control bytes in a single instruction
+#define PROBE_WIDTH 16
+
+// Control byte of a slot that doesn't hold a group
+// occupied slots hold the low 7 bits of the key's hash instead
+#define CTRL_EMPTY 0x80
+
+// Room needed for the numbers of a single group: "=min/mean/max, "
+// min and max fit in an int16, the mean lies in between
+#define MAX_GROUP_OUTPUT sizeof("=-3276.8/-3276.8/-3276.8, ")
+
+// Temperatures lie in [-99.9, 99.9], so a histogram of every tenth of a
+// degree takes HIST_BUCKETS counters (bucket 0 holds -99.9)
+// histograms are stored HIST_STRIDE counters apart, a multiple of 8,
+// so that they can be merged 8 counters at a time
+#define HIST_BUCKETS 1999
+#define HIST_OFFSET 999
+#define HIST_STRIDE 2000
+
+// Room needed for a percentile (or standard deviation) of a group: "/-3276.8"
+#define MAX_PERCENTILE_OUTPUT sizeof("/-3276.8")
+
+// Size of a (transparent) huge page on x86-64 and most arm64 kernels
+#define HUGE_PAGE_SIZE ((size_t)(1 << 20) * 2)
+
+// Memory used by the hashmaps, groups and keys of all results combined
+// checked against memory_limit (if non-zero) whenever these grow
+static size_t memory_limit;
+static atomic_size_t memory_used;
+
+// Whether to ask for huge pages for the input mapping and hashmaps
+static int huge_pages = 0;
+static atomic_int huge_pages_refused;
+
+// Set on a thread once it runs out of table memory (or past memory_limit),
+// which is reported on stderr: from then on, rows of keys there's no room
+// for end up in a spare group (see hashmap_entry), so whatever the thread
+// builds is incomplete and only good for freeing
+static _Thread_local int out_of_memory;
+
+// Where table memory comes from instead, if a program embedding the
+// engine says so (see brc_set_memory)
+static void *(*table_hook_realloc)(void *arena, void *ptr, size_t old_size,
+                                   size_t size);
+static void (*table_hook_free)(void *arena, void *ptr, size_t size);
+static void *table_hook_arena;
+
+// Workers merge their results pairwise as they finish:
+// a result waiting for a partner, and the number of results still around
+// merge_failed is set if any of those merges failed
+static _Atomic(struct Result *) pending_result;
+static atomic_uint results_left;
+static atomic_bool merge_failed;
+
+// Aggregated temperatures of a single group
+// these are touched for every row, so they are kept apart from the keys
+// and small enough for all groups of a thread to stay in L2
+struct Group {
+  int64_t sum;
+  uint32_t count;
+  int16_t min;
+  int16_t max;
+};
+
+// Location of a group's key in the key arena
+// only needed when inserting, merging or printing a group
+struct Key {
+  uint32_t offset;
+  uint32_t len;
+};
+
+struct Result {
+  unsigned int n;
+
+  // hashmap from key to index in the groups array
+  // a group is only compared against the key if its control byte matches
+  unsigned int capacity;
+  uint8_t *ctrl;
+  unsigned int *slots;
+
+  // room for HASHMAP_GROUP_ROOM(capacity) groups
+  struct Group *groups;
+  struct Key *keys;
+
+  // NUL-terminated keys of all groups, back to back
+  char *arena;
+  size_t arena_size;
+  size_t arena_capacity;
+
+  // if kept, a histogram of the temperatures of every group: 16-bit
+  // counters, 4 KB a group, with those that wrap around carrying into
+  // 32-bit counters of 65536 each, which a group only gets once it needs them
+  uint16_t *hist;
+  uint32_t **wide;
+
+  // if kept, the sum of the squares of every group's temperatures, for
+  // the variance; exact, as UINT32_MAX rows of 999^2 still fit in 64 bits
+  uint64_t *squares;
+
+  // results merged into this one, freed along with it
+  struct Result *merged;
+};
+
+// A group along with its key, for sorting and printing
+struct Entry {
+  const char *key;
+  unsigned int len;
+  const struct Group *group;
+};
+
+static inline int min(int a, int b) { return a < b ? a : b; }
+static inline int max(int a, int b) { return a > b ? a : b; }
+
+// qsort callback
+static inline int cmp(const void *ptr_a, const void *ptr_b) {
+  return strcmp(((struct Entry *)ptr_a)->key, ((struct Entry *)ptr_b)->key);
+}
+
+// mixes the first 16 bytes of a key (zero-padded) into a hash
+// longer keys only differ in their tail, which memcmp takes care of
+static inline unsigned int hash_words(uint64_t w0, uint64_t w1) {
+  uint64_t x = w0 ^ ((w1 << 31) | (w1 >> 33));
+  x ^= x >> 32;
+  x *= 0x9E3779B97F4A7C15ULL;
+  x ^= x >> 29;
+  return (unsigned int)x;
+}
+
+// hashes a key of known length without reading past its end
+static inline unsigned int hash_key(const char *key, size_t len) {
+  uint64_t w[2] = {0, 0};
+  memcpy(w, key, len < sizeof(w) ? len : sizeof(w));
+  return hash_words(w[0], w[1]);
+}
+
+// anonymous memory for tables of at least a huge page is mapped
+// at a huge page boundary and rounded up to whole huge pages
+static size_t huge_size(size_t size) {
+  size_t align = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 4096;
+  return (size + align - 1) & ~(align - 1);
+}
+
+static void *huge_alloc(size_t size) {
+  const size_t len = huge_size(size);
+  const size_t slack = len >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 0;
+  char *p = mmap(NULL, len + slack, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap error");
+    return NULL;
+  }
+  if (slack == 0) {
+    return p;
+  }
+
+  // give back whatever lies outside of the aligned range
+  char *aligned =
+      (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  if (aligned > p) {
+    munmap(p, (size_t)(aligned - p));
+  }
+  if (p + slack > aligned) {
+    munmap(aligned + len, (size_t)(p + slack - aligned));
+  }
+#ifdef MADV_HUGEPAGE
+  if (madvise(aligned, len, MADV_HUGEPAGE) != 0) {
+    atomic_store(&huge_pages_refused, 1);
+  }
+#endif
+  return aligned;
+}
+
+// resizes a block of table memory from old_size to size bytes
+// returns NULL (leaving ptr as it is, and setting out_of_memory) if that
+// would take us over the memory limit, or there's no memory left
+static void *table_realloc(void *ptr, size_t old_size, size_t size) {
+  size_t used = atomic_fetch_add(&memory_used, size - old_size) + size -
+                old_size;
+  void *p = NULL;
+  if (memory_limit > 0 && used > memory_limit) {
+    fprintf(stderr,
+            "memory limit of %zu bytes exceeded, "
+            "try again with a larger --memory-limit\n",
+            memory_limit);
+  } else if (table_hook_realloc) {
+    p = table_hook_realloc(table_hook_arena, ptr, old_size, size);
+    if (!p) {
+      fprintf(stderr, "out of table memory\n");
+    }
+  } else if (huge_pages) {
+    p = huge_alloc(size);
+    if (p && ptr) {
+      memcpy(p, ptr, old_size < size ? old_size : size);
+      munmap(ptr, huge_size(old_size));
+    }
+  } else {
+    p = realloc(ptr, size);
+    if (!p) {
+      perror("realloc error");
+    }
+  }
+
+  if (!p) {
+    atomic_fetch_sub(&memory_used, size - old_size);
+    out_of_memory = 1;
+  }
+  return p;
+}
+
+// gives back a block of table memory of size bytes, if there is one,
+// without taking it off memory_used
+static void table_release(void *ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+  if (table_hook_free) {
+    table_hook_free(table_hook_arena, ptr, size);
+  } else if (huge_pages) {
+    munmap(ptr, huge_size(size));
+  } else {
+    free(ptr);
+  }
+}
+
+// frees a block of table memory of size bytes, if there is one
+static void table_free(void *ptr, size_t size) {
+  if (ptr) {
+    atomic_fetch_sub(&memory_used, size);
+    table_release(ptr, size);
+  }
+}
+
+// empties the spare group after the others (see hashmap_entry)
+static void result_clear_spare(struct Result *result) {
+  const unsigned int c = HASHMAP_MAX_GROUPS(result->capacity);
+  result->groups[c] = (struct Group){.min = INT16_MAX, .max = INT16_MIN};
+  if (result->hist) {
+    memset(&result->hist[(size_t)c * HIST_STRIDE], 0,
+           HIST_STRIDE * sizeof(uint16_t));
+    result->wide[c] = NULL;
+  }
+  if (result->squares) {
+    result->squares[c] = 0;
+  }
+}
+
+// moves the groups and keys of result to tables for a hashmap of the given
+// capacity, whose slots are all empty (hashmap_grow fills them again)
+// returns 0, leaving result as it is, if there's no memory for that
+static int result_reserve(struct Result *result, unsigned int capacity) {
+  const size_t old_room =
+      result->ctrl ? HASHMAP_GROUP_ROOM(result->capacity) : 0;
+  const size_t room = HASHMAP_GROUP_ROOM(capacity);
+  const size_t slot_size = sizeof(*result->ctrl) + sizeof(*result->slots);
+  const size_t hist_size = HIST_STRIDE * sizeof(uint16_t);
+  const size_t group_size =
+      sizeof(*result->groups) + sizeof(*result->keys) +
+      (result->hist ? hist_size + sizeof(*result->wide) : 0) +
+      (result->squares ? sizeof(*result->squares) : 0);
+  const size_t old_size =
+      result->ctrl ? result->capacity * slot_size + old_room * group_size : 0;
+
+  // control bytes and slots share a single allocation
+  // all new tables are allocated before any of the old ones are freed,
+  // but as with realloc, only the growth counts towards the memory limit:
+  // the old ones are taken off memory_used up front
+  atomic_fetch_sub(&memory_used, old_size);
+  uint8_t *ctrl = table_realloc(NULL, 0, capacity * slot_size);
+  struct Group *groups = table_realloc(NULL, 0, room * sizeof(*groups));
+  struct Key *keys = table_realloc(NULL, 0, room * sizeof(*keys));
+  uint16_t *hist = NULL;
+  uint32_t **wide = NULL;
+  uint64_t *squares = NULL;
+  if (result->hist) {
+    hist = table_realloc(NULL, 0, room * hist_size);
+    wide = table_realloc(NULL, 0, room * sizeof(*wide));
+  }
+  if (result->squares) {
+    squares = table_realloc(NULL, 0, room * sizeof(*squares));
+  }
+  if (!ctrl || !groups || !keys || (result->hist && (!hist || !wide)) ||
+      (result->squares && !squares)) {
+    table_free(ctrl, capacity * slot_size);
+    table_free(groups, room * sizeof(*groups));
+    table_free(keys, room * sizeof(*keys));
+    table_free(hist, room * hist_size);
+    table_free(wide, room * sizeof(*wide));
+    table_free(squares, room * sizeof(*squares));
+    atomic_fetch_add(&memory_used, old_size);
+    return 0;
+  }
+
+  if (result->n > 0) {
+    const size_t n = result->n;
+    memcpy(groups, result->groups, n * sizeof(*groups));
+    memcpy(keys, result->keys, n * sizeof(*keys));
+    if (hist) {
+      memcpy(hist, result->hist, n * hist_size);
+      memcpy(wide, result->wide, n * sizeof(*wide));
+    }
+    if (squares) {
+      memcpy(squares, result->squares, n * sizeof(*squares));
+    }
+  }
+  table_release(result->ctrl, result->capacity * slot_size);
+  table_release(result->groups, old_room * sizeof(*groups));
+  table_release(result->keys, old_room * sizeof(*keys));
+  table_release(result->hist, old_room * hist_size);
+  table_release(result->wide, old_room * sizeof(*wide));
+  table_release(result->squares, old_room * sizeof(*squares));
+
+  memset(ctrl, CTRL_EMPTY, capacity);
+  result->ctrl = ctrl;
+  result->slots = (unsigned int *)&ctrl[capacity];
+  result->capacity = capacity;
+  result->groups = groups;
+  result->keys = keys;
+  result->hist = hist;
+  result->wide = wide;
+  result->squares = squares;
+  result_clear_spare(result);
+  return 1;
+}
+
+// makes result keep a histogram of every group from now on
+// (it should still be empty)
+// returns 0 if there's no memory for that
+static inline int result_keep_histograms(struct Result *result) {
+  const size_t room = HASHMAP_GROUP_ROOM(result->capacity);
+  const size_t hist_size = room * HIST_STRIDE * sizeof(uint16_t);
+  uint16_t *hist = table_realloc(NULL, 0, hist_size);
+  uint32_t **wide = table_realloc(NULL, 0, room * sizeof(*wide));
+  if (!hist || !wide) {
+    table_free(hist, hist_size);
+    table_free(wide, room * sizeof(*wide));
+    return 0;
+  }
+  result->hist = hist;
+  result->wide = wide;
+  result_clear_spare(result);
+  return 1;
+}
+
+// makes result keep the sum of squares of every group from now on
+// (it should still be empty)
+// returns 0 if there's no memory for that
+static inline int result_keep_squares(struct Result *result) {
+  const size_t room = HASHMAP_GROUP_ROOM(result->capacity);
+  result->squares = table_realloc(NULL, 0, room * sizeof(*result->squares));
+  if (!result->squares) {
+    return 0;
+  }
+  result_clear_spare(result);
+  return 1;
+}
+
+// returns a new, empty result, or NULL if there's no memory for it
+static struct Result *result_new(void) {
+  struct Result *result = calloc(1, sizeof(*result));
+  if (!result) {
+    perror("malloc error");
+    out_of_memory = 1;
+    return NULL;
+  }
+  result->arena = table_realloc(NULL, 0, KEY_ARENA_SIZE);
+  if (!result->arena ||
+      !result_reserve(result, HASHMAP_INITIAL_CAPACITY)) {
+    table_free(result->arena, KEY_ARENA_SIZE);
+    free(result);
+    return NULL;
+  }
+  result->arena_capacity = KEY_ARENA_SIZE;
+  return result;
+}
+
+// empties result, keeping its tables to be filled again
+static inline void result_clear(struct Result *result) {
+  if (result->hist) {
+    for (unsigned int c = 0; c < result->n; c++) {
+      free(result->wide[c]);
+    }
+  }
+  memset(result->ctrl, CTRL_EMPTY, result->capacity);
+  result->n = 0;
+  result->arena_size = 0;
+  result_clear_spare(result);
+}
+
+static void result_free(struct Result *result) {
+  if (result->merged) {
+    result_free(result->merged);
+  }
+  const size_t room = HASHMAP_GROUP_ROOM(result->capacity);
+  table_free(result->ctrl, result->capacity * (sizeof(*result->ctrl) +
+                                               sizeof(*result->slots)));
+  table_free(result->groups, room * sizeof(*result->groups));
+  table_free(result->keys, room * sizeof(*result->keys));
+  table_free(result->arena, result->arena_capacity);
+  if (result->hist) {
+    for (unsigned int c = 0; c < result->n; c++) {
+      free(result->wide[c]);
+    }
+    table_free(result->hist, room * HIST_STRIDE * sizeof(uint16_t));
+    table_free(result->wide, room * sizeof(*result->wide));
+  }
+  table_free(result->squares, room * sizeof(*result->squares));
+  free(result);
+}
+
+static inline const char *group_key(const struct Result *result,
+                                    unsigned int c) {
+  return &result->arena[result->keys[c].offset];
+}
+
+static inline int key_equals(const struct Result *result, unsigned int c,
+                             const char *key, unsigned int len) {
+  return result->keys[c].len == len &&
+         memcmp(group_key(result, c), key, len) == 0;
+}
+
+// makes room in the key arena for size more bytes
+// returns 0 if there's no memory for that (or there was none before on
+// this thread, so that running out is only reported once)
+static int arena_reserve(struct Result *result, size_t size) {
+  if (result->arena_size + size <= result->arena_capacity) {
+    return 1;
+  }
+  if (out_of_memory) {
+    return 0;
+  }
+  size_t capacity = result->arena_capacity * 2;
+  while (result->arena_size + size > capacity) {
+    capacity *= 2;
+  }
+  if (capacity > UINT32_MAX) {
+    fprintf(stderr, "key arena exceeds 4 GB\n");
+    out_of_memory = 1;
+    return 0;
+  }
+  char *arena = table_realloc(result->arena, result->arena_capacity, capacity);
+  if (!arena) {
+    return 0;
+  }
+  result->arena = arena;
+  result->arena_capacity = capacity;
+  return 1;
+}
+
+// adds a new (empty) group for the given key, which the key arena
+// has to have room for
+// returns its index in the results array
+static unsigned int result_add_group(struct Result *result, const char *key,
+                                     unsigned int len) {
+  unsigned int c = result->n++;
+  memcpy(&result->arena[result->arena_size], key, len);
+  result->arena[result->arena_size + len] = '\0';
+  result->keys[c].offset = (uint32_t)result->arena_size;
+  result->keys[c].len = len;
+  result->arena_size += len + 1;
+
+  result->groups[c].sum = 0;
+  result->groups[c].count = 0;
+  result->groups[c].min = INT16_MAX;
+  result->groups[c].max = INT16_MIN;
+  if (result->hist) {
+    memset(&result->hist[(size_t)c * HIST_STRIDE], 0,
+           HIST_STRIDE * sizeof(uint16_t));
+    result->wide[c] = NULL;
+  }
+  if (result->squares) {
+    result->squares[c] = 0;
+  }
+  return c;
+}
+
+// adds n times 65536 to bucket b of group c's histogram
+// the carry is lost if there's no memory for it (setting out_of_memory),
+// or if c is the spare group
+static void hist_carry(struct Result *result, unsigned int c, unsigned int b,
+                       uint32_t n) {
+  if (c >= result->n) {
+    return;
+  }
+  if (!result->wide[c]) {
+    result->wide[c] = calloc(HIST_STRIDE, sizeof(uint32_t));
+    if (!result->wide[c]) {
+      perror("malloc error");
+      out_of_memory = 1;
+      return;
+    }
+  }
+  result->wide[c][b] += n;
+}
+
+// counts a temperature (in tenths) in the histogram of group c
+static inline void hist_add(struct Result *result, unsigned int c,
+                            int temperature) {
+  const unsigned int b = (unsigned int)(temperature + HIST_OFFSET);
+  if (__builtin_expect(++result->hist[(size_t)c * HIST_STRIDE + b] == 0, 0)) {
+    hist_carry(result, c, b, 1);
+  }
+}
+
+// adds the histogram of group j of src to that of group c of dest
+static void hist_merge(struct Result *dest, unsigned int c,
+                       const struct Result *src, unsigned int j) {
+  uint16_t *a = &dest->hist[(size_t)c * HIST_STRIDE];
+  const uint16_t *b = &src->hist[(size_t)j * HIST_STRIDE];
+#ifdef __SSE2__
+  // 8 counters at a time, a sum that wrapped around differs from the
+  // saturated one, and carries
+  for (unsigned int i = 0; i < HIST_STRIDE; i += 8) {
+    const __m128i x = _mm_loadu_si128((const __m128i *)&a[i]);
+    const __m128i y = _mm_loadu_si128((const __m128i *)&b[i]);
+    const __m128i sum = _mm_add_epi16(x, y);
+    const __m128i saturated = _mm_adds_epu16(x, y);
+    _mm_storeu_si128((__m128i *)&a[i], sum);
+    unsigned int wrapped =
+        ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi16(sum, saturated)) &
+        0xFFFF;
+    while (wrapped) {
+      hist_carry(dest, c, i + (unsigned int)__builtin_ctz(wrapped) / 2, 1);
+      wrapped &= wrapped - 1;
+      wrapped &= wrapped - 1;
+    }
+  }
+#else
+  for (unsigned int i = 0; i < HIST_STRIDE; i++) {
+    const uint16_t sum = (uint16_t)(a[i] + b[i]);
+    if (sum < a[i]) {
+      hist_carry(dest, c, i, 1);
+    }
+    a[i] = sum;
+  }
+#endif
+  if (src->wide[j]) {
+    for (unsigned int i = 0; i < HIST_STRIDE; i++) {
+      if (src->wide[j][i]) {
+        hist_carry(dest, c, i, src->wide[j][i]);
+      }
+    }
+  }
+}
+
+// returns the lowest temperature (in tenths) of group c that at least
+// p percent of its temperatures are at or below (the nearest rank)
+// the rank is worked out in millionths of a percent, as integers, since
+// p / 100 * count in floating point can land just past a whole rank
+static inline int hist_percentile(const struct Result *result, unsigned int c,
+                                  double p) {
+  const uint16_t *hist = &result->hist[(size_t)c * HIST_STRIDE];
+  const uint32_t *wide = result->wide[c];
+  const uint64_t millionths = (uint64_t)(p * 1000000 + 0.5);
+  const uint64_t scaled = millionths * result->groups[c].count;
+  uint64_t rank = (scaled + 100000000 - 1) / 100000000;
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b] + (wide ? (uint64_t)wide[b] << 16 : 0);
+    if (seen >= rank) {
+      return (int)b - HIST_OFFSET;
+    }
+  }
+  return result->groups[c].max;
+}
+
+// returns a bitmask of the control bytes in ctrl[0..PROBE_WIDTH) equal to c
+static inline unsigned int ctrl_match(const uint8_t *ctrl, uint8_t c) {
+#ifdef __SSE2__
+  __m128i v = _mm_loadu_si128((const __m128i *)ctrl);
+  __m128i eq = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)c));
+  return (unsigned int)_mm_movemask_epi8(eq);
+#else
+  unsigned int mask = 0;
+  for (unsigned int i = 0; i < PROBE_WIDTH; i++) {
+    mask |= (unsigned int)(ctrl[i] == c) << i;
+  }
+  return mask;
+#endif
+}
+
+// returns the position of the first empty slot for hash h
+static unsigned int hashmap_free_slot(const struct Result *result,
+                                      unsigned int h) {
+  unsigned int pos = (h >> 7) & (result->capacity - PROBE_WIDTH);
+  unsigned int empty;
+  while ((empty = ctrl_match(&result->ctrl[pos], CTRL_EMPTY)) == 0) {
+    pos = (pos + PROBE_WIDTH) & (result->capacity - 1);
+  }
+  return pos + (unsigned int)__builtin_ctz(empty);
+}
+
+// grows the hashmap to the given capacity and re-inserts all groups
+// this happens at most a handful of times per thread
+// returns 0, leaving result as it is, if there's no memory for that
+// (or there was none before on this thread)
+static int hashmap_grow(struct Result *result, unsigned int capacity) {
+  if (out_of_memory || !result_reserve(result, capacity)) {
+    return 0;
+  }
+  for (unsigned int c = 0; c < result->n; c++) {
+    unsigned int h = hash_key(group_key(result, c), result->keys[c].len);
+    unsigned int i = hashmap_free_slot(result, h);
+    result->ctrl[i] = h & 0x7F;
+    result->slots[i] = c;
+  }
+  return 1;
+}
+
+// returns the index of the group for the given key in our results array
+// adding a new group if the key isn't in the hashmap yet
+// if there's no memory for a new group, the spare one after the others is
+// returned instead: it takes the rows nobody will look at, as the result
+// is incomplete anyway (and out_of_memory tells)
+static inline unsigned int hashmap_entry(struct Result *result,
+                                         const char *key, unsigned int len,
+                                         unsigned int h) {
+  const uint8_t fingerprint = h & 0x7F;
+  unsigned int pos = (h >> 7) & (result->capacity - PROBE_WIDTH);
+
+  // probe map one group of slots at a time until match or free spot
+  while (1) {
+    unsigned int match = ctrl_match(&result->ctrl[pos], fingerprint);
+    while (match) {
+      unsigned int i = pos + (unsigned int)__builtin_ctz(match);
+      if (key_equals(result, result->slots[i], key, len)) {
+        return result->slots[i];
+      }
+      match &= match - 1;
+    }
+
+    unsigned int empty = ctrl_match(&result->ctrl[pos], CTRL_EMPTY);
+    if (empty) {
+      unsigned int i = pos + (unsigned int)__builtin_ctz(empty);
+      if (result->n == HASHMAP_MAX_GROUPS(result->capacity)) {
+        if (!hashmap_grow(result, result->capacity * 2)) {
+          return HASHMAP_MAX_GROUPS(result->capacity);
+        }
+        i = hashmap_free_slot(result, h);
+      }
+      if (!arena_reserve(result, (size_t)len + 1)) {
+        return HASHMAP_MAX_GROUPS(result->capacity);
+      }
+      result->ctrl[i] = fingerprint;
+      result->slots[i] = result_add_group(result, key, len);
+      return result->slots[i];
+    }
+
+    pos = (pos + PROBE_WIDTH) & (result->capacity - 1);
+  }
+}
+
+// returns the index of the group for the given key, or result->n if the key
+// isn't in the hashmap
+static inline unsigned int hashmap_find(const struct Result *result,
+                                        const char *key, unsigned int len,
+                                        unsigned int h) {
+  const uint8_t fingerprint = h & 0x7F;
+  unsigned int pos = (h >> 7) & (result->capacity - PROBE_WIDTH);
+  while (1) {
+    unsigned int match = ctrl_match(&result->ctrl[pos], fingerprint);
+    while (match) {
+      unsigned int i = pos + (unsigned int)__builtin_ctz(match);
+      if (key_equals(result, result->slots[i], key, len)) {
+        return result->slots[i];
+      }
+      match &= match - 1;
+    }
+    if (ctrl_match(&result->ctrl[pos], CTRL_EMPTY)) {
+      return result->n;
+    }
+    pos = (pos + PROBE_WIDTH) & (result->capacity - 1);
+  }
+}
+
+// adds the aggregates of b to a
+// returns 0 (leaving a as it is) if that's more rows than a group can count
+static inline int group_merge(struct Group *a, const struct Group *b) {
+  if (b->count > UINT32_MAX - a->count) {
+    fprintf(stderr, "too many rows for a single group\n");
+    return 0;
+  }
+  a->count += b->count;
+  a->sum += b->sum;
+  a->min = (int16_t)min(a->min, b->min);
+  a->max = (int16_t)max(a->max, b->max);
+  return 1;
+}
+
+// returns whether adding the histogram of group j of src to group c of dest
+// (a new group, if c is dest->n) needs 32-bit counters group c lacks
+static int hist_merge_widens(const struct Result *dest, unsigned int c,
+                             const struct Result *src, unsigned int j) {
+  if (src->wide[j]) {
+    return c >= dest->n || !dest->wide[c];
+  }
+  if (c >= dest->n || dest->wide[c]) {
+    return 0;
+  }
+  const uint16_t *a = &dest->hist[(size_t)c * HIST_STRIDE];
+  const uint16_t *b = &src->hist[(size_t)j * HIST_STRIDE];
+  for (unsigned int i = 0; i < HIST_STRIDE; i++) {
+    if ((uint32_t)a[i] + b[i] > UINT16_MAX) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// makes room in result for n more groups, whose keys take size bytes of
+// the arena, so that adding them can't run out of memory
+// returns 0 if there's no memory for that
+static int result_make_room(struct Result *result, unsigned int n,
+                            size_t size) {
+  unsigned int capacity = result->capacity;
+  while (HASHMAP_MAX_GROUPS(capacity) - result->n < n) {
+    if (capacity > UINT_MAX / 2) {
+      fprintf(stderr, "too many groups\n");
+      out_of_memory = 1;
+      return 0;
+    }
+    capacity *= 2;
+  }
+  return (capacity == result->capacity || hashmap_grow(result, capacity)) &&
+         arena_reserve(result, size);
+}
+
+// adds all groups of src to dest
+// returns 0 (leaving dest as it is) if a group would get too many rows,
+// or there's no memory for the new groups
+static int result_merge(struct Result *dest, const struct Result *src) {
+  const int hist = dest->hist && src->hist;
+
+  // check every group, and make room for those dest lacks, before touching
+  // it, so it's never half-merged
+  unsigned int added = 0;
+  size_t size = 0;
+  size_t widened = 0;
+  for (unsigned int j = 0; j < src->n; j++) {
+    const char *key = group_key(src, j);
+    unsigned int len = src->keys[j].len;
+    unsigned int c = hashmap_find(dest, key, len, hash_key(key, len));
+    if (c < dest->n &&
+        src->groups[j].count > UINT32_MAX - dest->groups[c].count) {
+      fprintf(stderr, "too many rows for a single group\n");
+      return 0;
+    }
+    if (c == dest->n) {
+      added++;
+      size += len + 1;
+    }
+    if (hist && hist_merge_widens(dest, c, src, j)) {
+      widened++;
+    }
+  }
+  if (!result_make_room(dest, added, size)) {
+    return 0;
+  }
+
+  // the 32-bit counters the histograms are going to carry into
+  uint32_t **wide = NULL;
+  if (widened > 0) {
+    wide = calloc(widened, sizeof(*wide));
+    for (size_t k = 0; wide && k < widened; k++) {
+      wide[k] = calloc(HIST_STRIDE, sizeof(uint32_t));
+      if (!wide[k]) {
+        while (k > 0) {
+          free(wide[--k]);
+        }
+        free(wide);
+        wide = NULL;
+      }
+    }
+    if (!wide) {
+      perror("malloc error");
+      out_of_memory = 1;
+      return 0;
+    }
+  }
+
+  for (unsigned int j = 0; j < src->n; j++) {
+    const char *key = group_key(src, j);
+    unsigned int len = src->keys[j].len;
+    unsigned int c = hashmap_entry(dest, key, len, hash_key(key, len));
+    group_merge(&dest->groups[c], &src->groups[j]);
+    if (hist) {
+      if (hist_merge_widens(dest, c, src, j)) {
+        dest->wide[c] = wide[--widened];
+      }
+      hist_merge(dest, c, src, j);
+    }
+    if (dest->squares && src->squares) {
+      dest->squares[c] += src->squares[j];
+    }
+  }
+  free(wide);
+  return 1;
+}
+
+// called by every worker once it's done, to merge its result with those
+// of the others while the slower workers are still busy
+// the worker that does the last merge returns the final result,
+// all others return NULL
+static inline struct Result *merge_results(struct Result *result) {
+  // a worker that had no memory for a result of its own only counts itself
+  // out (the run fails anyway, leaving the last result to the clean-up)
+  if (!result) {
+    atomic_fetch_sub(&results_left, 1);
+    return NULL;
+  }
+  while (1) {
+    struct Result *other = atomic_exchange(&pending_result, NULL);
+    if (other) {
+      // merge the smaller result into the bigger one
+      if (other->n > result->n) {
+        struct Result *tmp = result;
+        result = other;
+        other = tmp;
+      }
+      // freeing the other result is left to the clean-up at the very end
+      if (!result_merge(result, other)) {
+        atomic_store(&merge_failed, 1);
+      }
+      struct Result *last = other;
+      while (last->merged) {
+        last = last->merged;
+      }
+      last->merged = result->merged;
+      result->merged = other;
+      if (atomic_fetch_sub(&results_left, 1) == 2) {
+        return result;
+      }
+      continue;
+    }
+
+    if (atomic_load(&results_left) == 1) {
+      return result;
+    }
+
+    // leave our result for the next worker to finish
+    struct Result *expected = NULL;
+    if (atomic_compare_exchange_strong(&pending_result, &expected, result)) {
+      return NULL;
+    }
+  }
+}
+
+// returns the CPU quota of our cgroup (and its parents) from cgroup v2
+// cpu.max, rounded up to whole CPUs, or 0 if there is no quota
+static inline unsigned int cgroup_cpus(void) {
+  char path[4096] = "/sys/fs/cgroup";
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f) {
+    return 0;
+  }
+  // the v2 hierarchy is the line with hierarchy ID 0, e.g. "0::/user.slice"
+  char line[sizeof(path) - 32];
+  int found = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      strcat(path, &line[3]);
+      found = 1;
+      break;
+    }
+  }
+  fclose(f);
+  if (!found) {
+    return 0;
+  }
+
+  // walk up to the root, the strictest quota wins
+  unsigned int cpus = 0;
+  size_t len = strlen(path);
+  while (len > strlen("/sys/fs/cgroup")) {
+    strcpy(&path[len], "/cpu.max");
+    f = fopen(path, "r");
+    if (f) {
+      unsigned long quota, period;
+      if (fscanf(f, "%lu %lu", &quota, &period) == 2 && period > 0) {
+        unsigned int n = (unsigned int)((quota + period - 1) / period);
+        if (n > 0 && (cpus == 0 || n < cpus)) {
+          cpus = n;
+        }
+      }
+      fclose(f);
+    }
+    path[len] = '\0';
+    len = (size_t)(strrchr(path, '/') - path);
+    path[len] = '\0';
+  }
+  return cpus;
+}
+
+// returns the number of CPUs we may actually use:
+// those in our affinity mask, limited by the cgroup CPU quota
+static inline unsigned int available_cpus(void) {
+  cpu_set_t allowed;
+  unsigned int cpus = 1;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    cpus = (unsigned int)CPU_COUNT(&allowed);
+  }
+  unsigned int quota = cgroup_cpus();
+  if (quota > 0 && quota < cpus) {
+    cpus = quota;
+  }
+  return cpus > 0 ? cpus : 1;
+}
+
+// returns the mean temperature of a group in tenths of a degree,
+// rounded half up: floor(sum / count + 1/2)
+static inline int64_t mean_tenths(const struct Group *g) {
+  const int64_t num = 2 * g->sum + g->count;
+  const int64_t den = 2 * (int64_t)g->count;
+  int64_t q = num / den;
+  if (num % den < 0) {
+    q--;
+  }
+  return q;
+}
+
+// returns the (population) standard deviation of the temperatures of group c
+// in tenths of a degree, rounded half up like the mean
+// n * squares - sum^2 is n^2 times the variance, computed exactly in 128 bits
+static inline int64_t stddev_tenths(const struct Result *result,
+                                    unsigned int c) {
+  const struct Group *g = &result->groups[c];
+  if (g->count == 0) {
+    return 0;
+  }
+  const __int128 n = g->count;
+  const __int128 v = n * result->squares[c] - (__int128)g->sum * g->sum;
+  if (v <= 0) {
+    return 0;
+  }
+
+  // integer square root of v by Newton's method, from above:
+  // v is below 2^32 * 2^64, so its root is below 2^48
+  unsigned __int128 x = (unsigned __int128)1 << 48;
+  while (x * x > (unsigned __int128)v) {
+    x = (x + (unsigned __int128)v / x) / 2;
+  }
+
+  // the largest q with (q - 1/2) * n <= sqrt(v): ((2q - 1) n)^2 <= 4v
+  int64_t q = (int64_t)(x / g->count);
+  while ((2 * (q + 1) - 1) * n * ((2 * (q + 1) - 1) * n) <= 4 * v) {
+    q++;
+  }
+  while (q > 0 && (2 * q - 1) * n * ((2 * q - 1) * n) > 4 * v) {
+    q--;
+  }
+  return q;
+}
+
+// parses a temperature like -12.3 into tenths
+// returns 0 if it's not a valid temperature
+static inline int parse_tenths(const char *s, size_t len, int *dest) {
+  int sign = 1;
+  if (len > 0 && *s == '-') {
+    sign = -1;
+    s++;
+    len--;
+  }
+  if (len < 3 || len > 4 || s[len - 2] != '.') {
+    return 0;
+  }
+  int value = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (i == len - 2) {
+      continue;
+    }
+    if (s[i] < '0' || s[i] > '9') {
+      return 0;
+    }
+    value = value * 10 + (s[i] - '0');
+  }
+  *dest = sign * value;
+  return 1;
+}
+
+// writes a number of tenths with a single decimal, e.g. -123 as -12.3
+// returns a pointer past the last character written
+static inline char *format_tenths(char *dest, int64_t tenths) {
+  if (tenths < 0) {
+    *dest++ = '-';
+    tenths = -tenths;
+  }
+  uint64_t v = (uint64_t)tenths;
+
+  // digits are written back to front
+  char digits[24];
+  char *p = &digits[sizeof(digits)];
+  *--p = (char)('0' + v % 10);
+  *--p = '.';
+  v /= 10;
+  do {
+    *--p = (char)('0' + v % 10);
+    v /= 10;
+  } while (v > 0);
+
+  size_t len = (size_t)(&digits[sizeof(digits)] - p);
+  memcpy(dest, p, len);
+  return dest + len;
+}
+
+// returns the size of the buffer format_results renders into,
+// with extra numbers (like percentiles) after the max of every group
+static inline size_t format_size(const struct Entry *entries, unsigned int n,
+                                 size_t extra) {
+  size_t size = 3;
+  for (unsigned int i = 0; i < n; i++) {
+    size += entries[i].len + MAX_GROUP_OUTPUT + extra * MAX_PERCENTILE_OUTPUT;
+  }
+  return size;
+}
+
+// renders the groups of result in entries as {key=min/mean/max, ...}
+// followed by the standard deviation (if it keeps sums of squares) and
+// the given percentiles (from its histograms) after the max,
+// into a buffer of its own (so that it can be spliced into a pipe)
+// returns its size in *len, or NULL if there's no memory for it
+static inline char *format_results(const struct Result *result,
+                                   const struct Entry *entries, unsigned int n,
+                                   const double *percentiles,
+                                   size_t npercentiles, size_t *len) {
+  const size_t size =
+      format_size(entries, n, npercentiles + (result->squares != NULL));
+  char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    perror("mmap error");
+    return NULL;
+  }
+
+  char *dest = buf;
+  *dest++ = '{';
+  for (unsigned int i = 0; i < n; i++) {
+    const struct Group *g = entries[i].group;
+    memcpy(dest, entries[i].key, entries[i].len);
+    dest += entries[i].len;
+    *dest++ = '=';
+    dest = format_tenths(dest, g->min);
+    *dest++ = '/';
+    dest = format_tenths(dest, mean_tenths(g));
+    *dest++ = '/';
+    dest = format_tenths(dest, g->max);
+    if (result->squares) {
+      *dest++ = '/';
+      dest = format_tenths(
+          dest, stddev_tenths(result, (unsigned int)(g - result->groups)));
+    }
+    for (size_t j = 0; j < npercentiles; j++) {
+      *dest++ = '/';
+      dest = format_tenths(
+          dest, hist_percentile(result, (unsigned int)(g - result->groups),
+                                percentiles[j]));
+    }
+    if (i < n - 1) {
+      *dest++ = ',';
+      *dest++ = ' ';
+    }
+  }
+  *dest++ = '}';
+  *dest++ = '\n';
+
+  *len = (size_t)(dest - buf);
+  return buf;
+}
+
+// Aggregates of a single group as stored on disk:
+// key length, key, sum, count (64 bits), min and max, in native byte order
+// which takes GROUP_DISK_SIZE bytes after the key
+#define GROUP_DISK_SIZE                                                        \
+  (sizeof(int64_t) + sizeof(uint64_t) + 2 * sizeof(int16_t))
+static void write_group(FILE *f, const char *key, uint32_t len,
+                        const struct Group *g) {
+  const uint64_t count = g->count;
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(key, 1, len, f);
+  fwrite(&g->sum, sizeof(g->sum), 1, f);
+  fwrite(&count, sizeof(count), 1, f);
+  fwrite(&g->min, sizeof(g->min), 1, f);
+  fwrite(&g->max, sizeof(g->max), 1, f);
+}
+
+// returns the number of bytes left to read from f,
+// or SIZE_MAX if that isn't known (as for a pipe)
+static size_t bytes_left(FILE *f) {
+  struct stat sb;
+  const off_t pos = ftello(f);
+  if (pos == -1 || fstat(fileno(f), &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    return SIZE_MAX;
+  }
+  return sb.st_size > pos ? (size_t)(sb.st_size - pos) : 0;
+}
+
+// reads a group written by write_group into *key (grown as needed)
+// returns 0 at the end of the file or if the group is malformed
+static int read_group(FILE *f, char **key, size_t *key_capacity,
+                      uint32_t *len, struct Group *g) {
+  uint64_t count;
+  if (fread(len, sizeof(*len), 1, f) != 1) {
+    return 0;
+  }
+  // a key can't be longer than what's left of the file
+  if ((size_t)*len > bytes_left(f)) {
+    return 0;
+  }
+  if ((size_t)*len + 1 > *key_capacity) {
+    char *bigger = realloc(*key, (size_t)*len + 1);
+    if (!bigger) {
+      perror("realloc error");
+      out_of_memory = 1;
+      return 0;
+    }
+    *key = bigger;
+    *key_capacity = (size_t)*len + 1;
+  }
+  if (fread(*key, 1, *len, f) != *len ||
+      fread(&g->sum, sizeof(g->sum), 1, f) != 1 ||
+      fread(&count, sizeof(count), 1, f) != 1 ||
+      fread(&g->min, sizeof(g->min), 1, f) != 1 ||
+      fread(&g->max, sizeof(g->max), 1, f) != 1 || count == 0 ||
+      count > UINT32_MAX || g->min > g->max) {
+    return 0;
+  }
+  // the mean has to lie between min and max, which keeps it within what
+  // format_results makes room for (this can't overflow, as count fits in
+  // 32 bits and min and max in 16)
+  if (g->sum < (int64_t)g->min * (int64_t)count ||
+      g->sum > (int64_t)g->max * (int64_t)count) {
+    return 0;
+  }
+  g->count = (uint32_t)count;
+  return 1;
+}
+
+// writes all groups of result, in no particular order
+static void write_groups(FILE *f, const struct Result *result) {
+  for (unsigned int i = 0; i < result->n; i++) {
+    write_group(f, group_key(result, i), result->keys[i].len,
+                &result->groups[i]);
+  }
+}
+
+// reads n groups and adds them to result
+// returns 0 if the file is malformed, a group gets too many rows, or
+// there's no memory left (which out_of_memory tells apart)
+static int read_groups(FILE *f, struct Result *result, uint64_t n) {
+  char *key = NULL;
+  size_t key_capacity = 0;
+  uint32_t len;
+  struct Group g;
+  for (uint64_t i = 0; i < n; i++) {
+    if (!read_group(f, &key, &key_capacity, &len, &g)) {
+      free(key);
+      return 0;
+    }
+    unsigned int c = hashmap_entry(result, key, len, hash_key(key, len));
+    if (out_of_memory || !group_merge(&result->groups[c], &g)) {
+      free(key);
+      return 0;
+    }
+  }
+  free(key);
+  return 1;
+}
+
+// A file of partial aggregates: magic, number of groups, then the groups
+// these can be merged with each other, unlike the rounded text output
+#define PARTIAL_MAGIC "1brcagg1"
+
+static inline void write_partial(FILE *f, const struct Result *result) {
+  const uint64_t n = result->n;
+  fwrite(PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC) - 1, 1, f);
+  fwrite(&n, sizeof(n), 1, f);
+  write_groups(f, result);
+}
+
+// adds all groups in a file of partial aggregates to result
+// returns 0 if it's not such a file, or a malformed one
+// (or there's no memory left, see read_groups)
+static inline int read_partial(FILE *f, struct Result *result) {
+  char magic[sizeof(PARTIAL_MAGIC) - 1];
+  uint64_t n;
+  return fread(magic, sizeof(magic), 1, f) == 1 &&
+         memcmp(magic, PARTIAL_MAGIC, sizeof(magic)) == 0 &&
+         fread(&n, sizeof(n), 1, f) == 1 && read_groups(f, result, n);
+}
+
+// returns all groups of result along with their keys, sorted by key,
+// or NULL if there's no memory for them
+static inline struct Entry *sorted_entries(const struct Result *result) {
+  struct Entry *entries = malloc((result->n + 1) * sizeof(*entries));
+  if (!entries) {
+    perror("malloc error");
+    return NULL;
+  }
+  for (unsigned int i = 0; i < result->n; i++) {
+    entries[i].key = group_key(result, i);
+    entries[i].len = result->keys[i].len;
+    entries[i].group = &result->groups[i];
+  }
+  qsort(entries, (size_t)result->n, sizeof(*entries), cmp);
+  return entries;
+}
+
+// What the top K groups are ranked by
+enum Rank {
+  RANK_MAX,
+  RANK_MEAN,
+  RANK_MIN,
+};
+
+static inline int64_t rank_value(const struct Group *g, enum Rank by) {
+  return by == RANK_MAX ? g->max : by == RANK_MIN ? g->min : mean_tenths(g);
+}
+
+// returns whether a ranks below b: a lower value, or the same and a later key
+static inline int ranks_below(const struct Entry *a, const struct Entry *b,
+                              enum Rank by) {
+  const int64_t va = rank_value(a->group, by);
+  const int64_t vb = rank_value(b->group, by);
+  return va < vb || (va == vb && strcmp(a->key, b->key) > 0);
+}
+
+// restores the heap property below i of a heap of n entries,
+// which has the lowest ranked entry on top
+static inline void sift_down(struct Entry *heap, unsigned int n,
+                             unsigned int i, enum Rank by) {
+  while (1) {
+    unsigned int lowest = i;
+    const unsigned int l = 2 * i + 1;
+    const unsigned int r = l + 1;
+    if (l < n && ranks_below(&heap[l], &heap[lowest], by)) {
+      lowest = l;
+    }
+    if (r < n && ranks_below(&heap[r], &heap[lowest], by)) {
+      lowest = r;
+    }
+    if (lowest == i) {
+      return;
+    }
+    const struct Entry tmp = heap[i];
+    heap[i] = heap[lowest];
+    heap[lowest] = tmp;
+    i = lowest;
+  }
+}
+
+// returns the k groups of result ranked highest by the given value,
+// highest first, and their number in *n (NULL if there's no memory for
+// them)
+// only the best k so far are kept, in a heap, instead of sorting them all
+static inline struct Entry *top_entries(const struct Result *result,
+                                        unsigned int k, enum Rank by,
+                                        unsigned int *n) {
+  if (k > result->n) {
+    k = result->n;
+  }
+  struct Entry *heap = malloc((k + 1) * sizeof(*heap));
+  if (!heap) {
+    perror("malloc error");
+    return NULL;
+  }
+
+  unsigned int size = 0;
+  for (unsigned int i = 0; i < result->n && k > 0; i++) {
+    const struct Entry e = {group_key(result, i), result->keys[i].len,
+                            &result->groups[i]};
+    if (size < k) {
+      // sift up
+      unsigned int j = size++;
+      while (j > 0 && ranks_below(&e, &heap[(j - 1) / 2], by)) {
+        heap[j] = heap[(j - 1) / 2];
+        j = (j - 1) / 2;
+      }
+      heap[j] = e;
+    } else if (ranks_below(&heap[0], &e, by)) {
+      heap[0] = e;
+      sift_down(heap, size, 0, by);
+    }
+  }
+
+  // taking the lowest off the top, back to front, leaves them highest first
+  for (unsigned int end = size; end > 1; end--) {
+    const struct Entry tmp = heap[0];
+    heap[0] = heap[end - 1];
+    heap[end - 1] = tmp;
+    sift_down(heap, end - 1, 0, by);
+  }
+  *n = size;
+  return heap;
+}
+
+#endif
@@ -1,291 +1,834 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
-#include <stdatomic.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
-#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_DISTINCT_GROUPS 10000
-#define MAX_GROUPBY_KEY_LENGTH 100
+#include "brc.h"
 
-// Capacity of our hashmap
-// Needs to be a power of 2
-// so we can bit-and instead of modulo
-#define HASHMAP_CAPACITY 16384
-#define HASHMAP_INDEX(h) (h & (HASHMAP_CAPACITY - 1))
+#define BUFSIZE ((1<<10)*16)
+
+// Latencies of this many of the last queries are kept for percentiles
+#define LATENCY_WINDOW 1024
+
+// At most this many clients are served at once, more wait in the backlog
+#define MAX_CLIENTS 64
 
-#ifndef NTHREADS
-#define NTHREADS 16
+// A client has this long to send its query, and to take each part of
+// the answer, before it's dropped
+#define QUERY_TIMEOUT_NS 1000000000ull
+#define SEND_TIMEOUT_NS 10000000000ull
+
+// hands len bytes of output over to the parent through the pipe fd
+// on Linux, the pages of buf are spliced into the pipe instead of copied,
+// so buf must not be written to anymore afterwards
+static void hand_off(int fd, const char *buf, size_t len) {
+#ifdef F_SETPIPE_SZ
+  // fewer, bigger hand-offs
+  fcntl(fd, F_SETPIPE_SZ, 1 << 20);
 #endif
 
-#define BUFSIZE ((1<<10)*16)
+  while (len > 0) {
+#ifdef SPLICE_F_MOVE
+    struct iovec iov = {(void *)buf, len};
+    ssize_t n = vmsplice(fd, &iov, 1, 0);
+#else
+    ssize_t n = write(fd, buf, len);
+#endif
+    if (n == -1) {
+      perror("write error");
+      exit(EXIT_FAILURE);
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+}
 
-static size_t chunk_count;
-static size_t chunk_size;
-static atomic_uint chunk_selector;
+// copies everything from the pipe fd to stdout
+// moving the pages straight from one to the other if stdout allows it
+// returns 0 on failure
+static int forward_output(int fd) {
+  ssize_t n;
+#ifdef SPLICE_F_MOVE
+  do {
+    n = splice(fd, NULL, STDOUT_FILENO, NULL, 1 << 20, SPLICE_F_MOVE);
+  } while (n > 0);
+  if (n == 0) {
+    return 1;
+  }
+  // not every kind of stdout supports splice (e.g. terminals)
+  if (errno != EINVAL) {
+    perror("write error");
+    return 0;
+  }
+#endif
 
-struct Group {
-  unsigned int count;
-  int min;
-  int max;
-  long sum;
-  char key[MAX_GROUPBY_KEY_LENGTH];
-};
+  char buf[BUFSIZE];
+  while ((n = read(fd, buf, BUFSIZE)) > 0) {
+    if (write(STDOUT_FILENO, buf, (size_t)n) != n) {
+      perror("write error");
+      return 0;
+    }
+  }
+  if (n == -1) {
+    perror("read error");
+    return 0;
+  }
+  return 1;
+}
 
-struct Result {
-  unsigned int n;
-  unsigned int map[HASHMAP_CAPACITY];
-  struct Group groups[MAX_DISTINCT_GROUPS];
+// hands off the results of every file on a line of its own,
+// prefixed with its path
+static void hand_off_per_file(int fd, const struct brc *b) {
+  for (size_t i = 0; i < brc_files(b); i++) {
+    const char *path;
+    const struct brc *file = brc_file(b, i, &path);
+    size_t len;
+    char *output = brc_format(file, BRC_FORMAT_TEXT, &len);
+    if (!output) {
+      exit(EXIT_FAILURE);
+    }
+    // the path goes away along with b, so it's copied rather than spliced
+    if (dprintf(fd, "%s: ", path) < 0) {
+      perror("write error");
+      exit(EXIT_FAILURE);
+    }
+    hand_off(fd, output, len);
+  }
+}
+
+// With --serve, the files are aggregated once and the results are kept
+// along with their rendered output until the files change
+static struct brc_options serve_options;
+static const char *const *serve_paths;
+static size_t serve_npaths;
+static struct brc *served;
+static volatile sig_atomic_t stopping = 0;
+
+// the rendered output of a scan, kept until the last client sending it
+// is done, even if a later scan has replaced it
+struct output {
+  char *text;
+  size_t text_len;
+  char *binary;
+  size_t binary_len;
+  unsigned users;
 };
+static struct output *current;
+
+// a client connection, all of them are served at once from a single poll
+// loop so that a slow client doesn't hold up the others
+struct client {
+  int fd;
+  uint64_t start;
+  // when the client is dropped if it makes no progress
+  uint64_t deadline;
+  char query[64];
+  size_t query_len;
+  // what's left to send, from output or from reply
+  struct output *output;
+  char reply[256];
+  const char *buf;
+  size_t left;
+  int answered;
+};
+
+// query stats, latencies in nanoseconds
+static uint64_t queries = 0;
+static uint64_t scans = 0;
+static uint64_t last_scan;
+static uint64_t latency_total = 0;
+static uint64_t latency_max = 0;
+static uint64_t latencies[LATENCY_WINDOW];
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void stop(int sig) {
+  (void)sig;
+  stopping = 1;
+}
 
-// parses a floating point number as an integer
-// this is only possible because we know our data file has only a single decimal
-static inline const char *parse_number(int *dest, const char *s) {
-  // parse sign
-  int mod = 1;
-  if (*s == '-') {
-    mod = -1;
-    s++;
+// drops a reference to output, freeing it once nobody uses it anymore
+static void output_release(struct output *output) {
+  if (output && --output->users == 0) {
+    free(output->text);
+    brc_free_output(output->binary, output->binary_len);
+    free(output);
   }
+}
 
-  if (s[1] == '.') {
-    *dest = ((s[0] * 10) + s[2] - ('0' * 11)) * mod;
-    return s + 4;
+// aggregates the served files into a new struct brc and renders its output
+// returns 0 (keeping the previous results) if the files can't be read,
+// or there's no memory for them
+static int scan(void) {
+  const uint64_t start = now_ns();
+  struct brc *b = brc_new(&serve_options);
+  if (!b || brc_aggregate_files(b, serve_paths, serve_npaths) != 0) {
+    if (b) {
+      brc_free(b);
+    }
+    return 0;
+  }
+
+  // per-file lines (with -f) followed by the combined results
+  char *text;
+  size_t text_size;
+  FILE *f = open_memstream(&text, &text_size);
+  if (!f) {
+    perror("open_memstream error");
+    exit(EXIT_FAILURE);
+  }
+  int rendered = 1;
+  for (size_t i = 0; i <= brc_files(b); i++) {
+    const char *path = NULL;
+    const struct brc *r = i < brc_files(b) ? brc_file(b, i, &path) : b;
+    size_t len;
+    char *output = brc_format(r, BRC_FORMAT_TEXT, &len);
+    if (!output) {
+      rendered = 0;
+      break;
+    }
+    if (path) {
+      fprintf(f, "%s: ", path);
+    }
+    fwrite(output, 1, len, f);
+    brc_free_output(output, len);
+  }
+  if (fclose(f) != 0) {
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+  size_t len;
+  char *binary = rendered ? brc_format(b, BRC_FORMAT_PARTIAL, &len) : NULL;
+  struct output *output = binary ? malloc(sizeof(*output)) : NULL;
+  if (!output) {
+    if (binary) {
+      brc_free_output(binary, len);
+    }
+    free(text);
+    brc_free(b);
+    return 0;
   }
 
-  *dest = (s[0] * 100 + s[1] * 10 + s[3] - ('0' * 111)) * mod;
-  return s + 5;
+  *output = (struct output){text, text_size, binary, len, 1};
+  output_release(current);
+  current = output;
+  if (served) {
+    brc_free(served);
+  }
+  served = b;
+  scans++;
+  last_scan = now_ns() - start;
+  return 1;
 }
 
-static inline int min(int a, int b) { return a < b ? a : b; }
-static inline int max(int a, int b) { return a > b ? a : b; }
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
 
-// qsort callback
-static inline int cmp(const void *ptr_a, const void *ptr_b) {
-  return strcmp(((struct Group *)ptr_a)->key, ((struct Group *)ptr_b)->key);
+// renders the query stats on a single line into buf
+static int format_stats(char *buf, size_t size) {
+  const size_t n = queries < LATENCY_WINDOW ? queries : LATENCY_WINDOW;
+  uint64_t sorted[LATENCY_WINDOW] = {0};
+  memcpy(sorted, latencies, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), compare_u64);
+  // nearest rank, the smallest latency at least p% of queries didn't exceed
+  const size_t p50 = n > 0 ? (50 * n + 99) / 100 - 1 : 0;
+  const size_t p99 = n > 0 ? (99 * n + 99) / 100 - 1 : 0;
+  return snprintf(
+      buf, size,
+      "queries=%lu scans=%lu last_scan_us=%lu latency_us_mean=%lu "
+      "latency_us_p50=%lu latency_us_p99=%lu latency_us_max=%lu\n",
+      (unsigned long)queries, (unsigned long)scans,
+      (unsigned long)(last_scan / 1000),
+      (unsigned long)(queries ? latency_total / queries / 1000 : 0),
+      (unsigned long)(sorted[p50] / 1000),
+      (unsigned long)(sorted[p99] / 1000),
+      (unsigned long)(latency_max / 1000));
 }
 
-// returns a pointer to the slot in our hashmap
-// for storing the index in our results array
-static inline unsigned int *hashmap_entry(struct Result *result,
-                                          const char *key) {
-  unsigned int h = 0;
-  unsigned int len = 0;
-  for (; key[len] != '\0'; len++) {
-    h = (h * 31) + (unsigned char)key[len];
+// answers the query the client sent, rescanning the files first if they
+// changed, and starts sending the answer
+static void answer(struct client *c) {
+  char *query = c->query;
+  query[c->query_len] = '\0';
+  query[strcspn(query, "\r\n")] = '\0';
+
+  c->answered = 1;
+  if (strcmp(query, "") == 0 || strcmp(query, "results") == 0 ||
+      strcmp(query, "binary") == 0) {
+    if (brc_changed(served) && !scan()) {
+      fprintf(stderr, "rescan failed, serving the previous results\n");
+    }
+    c->output = current;
+    c->output->users++;
+    if (strcmp(query, "binary") == 0) {
+      c->buf = c->output->binary;
+      c->left = c->output->binary_len;
+    } else {
+      c->buf = c->output->text;
+      c->left = c->output->text_len;
+    }
+  } else if (strcmp(query, "stats") == 0) {
+    c->buf = c->reply;
+    c->left = (size_t)format_stats(c->reply, sizeof(c->reply));
+  } else {
+    static const char unknown[] =
+        "unknown query, try results, binary or stats\n";
+    c->buf = unknown;
+    c->left = sizeof(unknown) - 1;
   }
+  c->deadline = now_ns() + SEND_TIMEOUT_NS;
+}
 
-  unsigned int *c = &result->map[HASHMAP_INDEX(h)];
-  while (*c > 0 && memcmp(result->groups[*c].key, key, len) != 0) {
-    h++;
-    c = &result->map[HASHMAP_INDEX(h)];
+// closes the connection, counting the query if it was answered
+static void client_close(struct client *c) {
+  close(c->fd);
+  output_release(c->output);
+  if (!c->answered) {
+    return;
   }
+  const uint64_t latency = now_ns() - c->start;
+  latencies[queries++ % LATENCY_WINDOW] = latency;
+  latency_total += latency;
+  if (latency > latency_max) {
+    latency_max = latency;
+  }
+}
 
-  return c;
+// reads what the client sent of its query, and answers it once it has
+// the whole line (or the client stopped sending)
+// returns 0 if the client is done with
+static int client_read(struct client *c) {
+  const ssize_t n = recv(c->fd, &c->query[c->query_len],
+                         sizeof(c->query) - 1 - c->query_len, 0);
+  if (n == -1) {
+    return errno == EAGAIN || errno == EINTR;
+  }
+  c->query_len += (size_t)n;
+  if (n == 0 || c->query_len == sizeof(c->query) - 1 ||
+      memchr(c->query, '\n', c->query_len)) {
+    answer(c);
+  }
+  return 1;
 }
 
-static void *process_chunk(void *_data) {
-  char *data = (char *)_data;
+// sends as much of the answer as the client takes without blocking
+// returns 0 if the client is done with, or went away
+static int client_write(struct client *c) {
+  while (c->left > 0) {
+    const ssize_t n = send(c->fd, c->buf, c->left, MSG_NOSIGNAL);
+    if (n == -1) {
+      return errno == EAGAIN || errno == EINTR;
+    }
+    c->buf += n;
+    c->left -= (size_t)n;
+    c->deadline = now_ns() + SEND_TIMEOUT_NS;
+  }
+  return 0;
+}
 
-  // initialize result
-  struct Result *result = malloc(sizeof(*result));
-  if (!result) {
-    perror("malloc error");
+// aggregates the files once, then answers queries on a UNIX domain socket
+// at path until interrupted
+static void serve(const char *path) {
+  for (size_t i = 0; i < serve_npaths; i++) {
+    if (strcmp(serve_paths[i], "-") == 0) {
+      fprintf(stderr, "stdin can only be read once, it can't be served\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (!scan()) {
     exit(EXIT_FAILURE);
   }
-  result->n = 0;
 
-  // we could do this in a single call to memset
-  // since the two are contiguous in memory
-  // but this code is only called NTHREADS times
-  // so not really worth it
-  memset(result->map, 0, HASHMAP_CAPACITY * sizeof(*result->map));
-  memset(result->groups, 0, MAX_DISTINCT_GROUPS * sizeof(*result->groups));
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: path too long\n", path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket error");
+    exit(EXIT_FAILURE);
+  }
+  // a socket left behind by an earlier run is replaced
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 64) != 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
 
-  // keep grabbing chunks until done
-  while (1) {
-    const unsigned int chunk = chunk_selector++;
-    if (chunk >= chunk_count) {
-      break;
+  // without SA_RESTART, so that poll returns when we're asked to stop
+  struct sigaction sa = {.sa_handler = stop};
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  fprintf(stderr, "serving on %s\n", path);
+
+  // the listening socket comes first, then one entry per client
+  static struct client clients[MAX_CLIENTS];
+  struct pollfd fds[MAX_CLIENTS + 1];
+  size_t nclients = 0;
+  while (!stopping) {
+    uint64_t now = now_ns();
+    int timeout = -1;
+    fds[0] = (struct pollfd){fd, nclients < MAX_CLIENTS ? POLLIN : 0, 0};
+    for (size_t i = 0; i < nclients; i++) {
+      const struct client *c = &clients[i];
+      fds[i + 1] = (struct pollfd){c->fd, c->answered ? POLLOUT : POLLIN, 0};
+      const uint64_t wait =
+          c->deadline > now ? (c->deadline - now + 999999) / 1000000 : 0;
+      if (timeout == -1 || wait < (uint64_t)timeout) {
+        timeout = (int)wait;
+      }
     }
-    size_t chunk_start = chunk * chunk_size;
-    size_t chunk_end = chunk_start + chunk_size;
-
-    // skip forward to next newline in chunk
-    const char *s = chunk_start > 0
-                  ? (char *)memchr(&data[chunk_start], '\n', chunk_size) + 1
-                  : &data[chunk_start];
-
-    // this assumes the file ends in a newline...
-    const char *end = (char *)memchr(&data[chunk_end], '\n', chunk_size) + 1;
-
-    // flaming hot loop
-    while (s != end) {
-      const char *linestart = s;
-
-      // find position of ;
-      // while simulatenuously hashing everything up to that point
-      unsigned int len = 0;
-      unsigned int h = 0;
-      while (s[len] != ';') {
-        h = (h * 31) + (unsigned char)s[len];
-        len += 1;
+    if (poll(fds, nclients + 1, timeout) == -1) {
+      if (errno != EINTR) {
+        perror("poll error");
+        exit(EXIT_FAILURE);
       }
+      continue;
+    }
 
-      // parse decimal number as int
-      int temperature;
-      s = parse_number(&temperature, linestart + len + 1);
-
-      // probe map until free spot or match
-      unsigned int *c = &result->map[HASHMAP_INDEX(h)];
-      while (*c > 0 && memcmp(result->groups[*c].key, linestart, len) != 0) {
-        h += 1;
-        c = &result->map[HASHMAP_INDEX(h)];
+    // a client that doesn't send its query in time is treated as asking
+    // for the results, one that doesn't take its answer is dropped
+    now = now_ns();
+    for (size_t i = nclients; i-- > 0;) {
+      struct client *c = &clients[i];
+      const short revents = fds[i + 1].revents;
+      int open = 1;
+      if (!c->answered) {
+        if (revents) {
+          open = client_read(c);
+        } else if (now >= c->deadline) {
+          answer(c);
+        }
       }
-
-      // new hashmap entry
-      if (*c == 0) {
-        *c = result->n;
-        memcpy(result->groups[*c].key, linestart, len);
-        result->n++;
+      if (open && c->answered) {
+        open = client_write(c) && now < c->deadline;
       }
+      if (!open) {
+        client_close(c);
+        *c = clients[--nclients];
+      }
+    }
 
-      // existing entry
-      result->groups[*c].count += 1;
-      result->groups[*c].min = min(result->groups[*c].min, temperature);
-      result->groups[*c].max = max(result->groups[*c].max, temperature);
-      result->groups[*c].sum += temperature;
+    if (fds[0].revents) {
+      while (nclients < MAX_CLIENTS) {
+        const int client =
+            accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client == -1) {
+          if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+            perror("accept error");
+          }
+          break;
+        }
+        now = now_ns();
+        clients[nclients++] = (struct client){
+            .fd = client, .start = now, .deadline = now + QUERY_TIMEOUT_NS};
+      }
     }
   }
 
-  return (void *)result;
+  for (size_t i = 0; i < nclients; i++) {
+    client_close(&clients[i]);
+  }
+  close(fd);
+  unlink(path);
+  char stats[256];
+  format_stats(stats, sizeof(stats));
+  fputs(stats, stderr);
+  output_release(current);
+  brc_free(served);
 }
 
-static void result_to_str(char *dest, const struct Result *result) {
-  *dest++ = '{';
+static void usage(void) {
+  fprintf(stderr,
+          "usage: analyze [-b] [-c cursors] [-e engine] [-f] [-H] "
+          "[-k checkpoint] [-m size] [-p] [-s socket] [-t threads] "
+          "[--station name]... [--top K [--by stat]] [--percentiles list] "
+          "[--stddev] [--index file [--rows range]] [file|dir...]\n"
+          "  -b, --binary           write partial aggregates "
+          "(for brc-merge) instead of text\n"
+          "      --by STAT          what --top ranks stations by: "
+          "max (default), mean or min\n"
+          "  -c, --cursors N        lines each thread processes in lockstep "
+          "(1-%d, default 2)\n"
+          "  -e, --engine NAME      read regular files with mmap (default) "
+          "or uring (io_uring + O_DIRECT)\n"
+          "  -f, --per-file         also print the results of every file "
+          "on a line of its own\n"
+          "  -H, --huge-pages       back the file mapping and hashmaps with "
+          "huge pages where possible\n"
+          "      --index FILE       answer from this index of the file "
+          "(see brc-index)\n"
+          "  -k, --checkpoint FILE  keep aggregates in FILE and only parse "
+          "what was appended since\n"
+          "  -m, --memory-limit N   fail instead of growing the hashmaps "
+          "past N bytes (K, M or G suffix)\n"
+          "  -p, --pin              pin worker threads to CPUs, "
+          "spread over NUMA nodes\n"
+          "      --rows A-B         only aggregate rows A up to B "
+          "(from 0, B excluded), needs --index\n"
+          "      --no-smt           pin to one hardware thread per core "
+          "(implies --pin)\n"
+          "      --percentiles LIST also print these percentiles of every "
+          "station after the max,\n"
+          "                         e.g. 50,95,99\n"
+          "  -s, --serve SOCKET     keep the results and answer queries "
+          "(results, binary, stats)\n"
+          "                         on a UNIX domain socket, rescanning "
+          "when the files change\n"
+          "      --station NAME     only aggregate this station, "
+          "may be given more than once\n"
+          "      --stddev           also print the standard deviation of "
+          "every station after the max\n"
+          "  -t, --threads N        number of worker threads "
+          "(1-%d, default: CPUs available to us)\n"
+          "      --top K            only print the K stations ranked highest, "
+          "highest first\n",
+          BRC_MAX_CURSORS, BRC_MAX_THREADS);
+}
 
-  for (unsigned int i = 0; i < result->n; i++) {
-    size_t n = (size_t)sprintf(
-        dest, "%s=%.1f/%.1f/%.1f%s", result->groups[i].key,
-        (float)result->groups[i].min / 10.0,
-        ((float)result->groups[i].sum / (float)result->groups[i].count) / 10.0,
-        (float)result->groups[i].max / 10.0, i < (result->n - 1) ? ", " : "");
+// parses a list of percentiles like 50,95,99.9 into dest (room for n)
+// returns how many there are, 0 if the list is not valid
+static size_t parse_percentiles(const char *s, double *dest, size_t n) {
+  size_t count = 0;
+  while (count < n) {
+    char *end;
+    const double p = strtod(s, &end);
+    if (end == s || !(p >= 0 && p <= 100)) {
+      return 0;
+    }
+    dest[count++] = p;
+    if (*end == '\0') {
+      return count;
+    }
+    if (*end != ',') {
+      return 0;
+    }
+    s = end + 1;
+  }
+  return 0;
+}
 
-    dest += n;
+// parses a size like 512K, 64M or 2G into a number of bytes
+// returns 0 if the size is not valid
+static size_t parse_size(const char *s) {
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'G':
+  case 'g':
+    n <<= 10;
+    // fall through
+  case 'M':
+  case 'm':
+    n <<= 10;
+    // fall through
+  case 'K':
+  case 'k':
+    n <<= 10;
+    end++;
+    break;
   }
+  return *end == '\0' ? (size_t)n : 0;
+}
+
+// parses a whole number in [1, max], returns 0 if it's anything else
+static long parse_count(const char *s, long max) {
+  char *end;
+  errno = 0;
+  long n = strtol(s, &end, 10);
+  return end != s && *end == '\0' && errno == 0 && n >= 1 && n <= max ? n : 0;
+}
 
-  *dest++ = '}';
-  *dest++ = '\n';
-  *dest = '\0';
+// parses a range of rows like 200000000-400000000, where either end may be
+// left out, into [*first, *last) (with *last 0 for up to the end)
+// returns 0 if it's not a range
+static int parse_rows(const char *s, uint64_t *first, uint64_t *last) {
+  char *end;
+  *first = *s == '-' ? 0 : strtoull(s, &end, 10);
+  if (*s != '-' && (end == s || *end != '-')) {
+    return 0;
+  }
+  s = strchr(s, '-') + 1;
+  *last = *s == '\0' ? 0 : strtoull(s, &end, 10);
+  if (*s != '\0' && (end == s || *end != '\0')) {
+    return 0;
+  }
+  return *last == 0 || *last > *first;
 }
 
 int main(int argc, char **argv) {
-  // set-up pipes for communication
-  // then fork into child process which does the actual work
-  // this allows us to skip the time the system spends doing munmap
-  int pipefd[2];
-  if (pipe(pipefd) != 0) {
-    perror("pipe error");
+  static const struct option long_options[] = {
+      {"binary", no_argument, NULL, 'b'},
+      {"by", required_argument, NULL, 'B'},
+      {"cursors", required_argument, NULL, 'c'},
+      {"engine", required_argument, NULL, 'e'},
+      {"per-file", no_argument, NULL, 'f'},
+      {"huge-pages", no_argument, NULL, 'H'},
+      {"index", required_argument, NULL, 'I'},
+      {"checkpoint", required_argument, NULL, 'k'},
+      {"memory-limit", required_argument, NULL, 'm'},
+      {"percentiles", required_argument, NULL, 'P'},
+      {"pin", no_argument, NULL, 'p'},
+      {"rows", required_argument, NULL, 'R'},
+      {"serve", required_argument, NULL, 's'},
+      {"station", required_argument, NULL, 'N'},
+      {"stddev", no_argument, NULL, 'D'},
+      {"no-smt", no_argument, NULL, 'S'},
+      {"threads", required_argument, NULL, 't'},
+      {"top", required_argument, NULL, 'T'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  int binary = 0;
+  const char *socket_path = NULL;
+  struct brc_options options = {0};
+  struct brc_memory memory = {0};
+  const char **stations = malloc((size_t)argc * sizeof(*stations));
+  if (!stations) {
+    perror("malloc error");
     exit(EXIT_FAILURE);
   }
-  pid_t pid;
-  pid = fork();
-  if (pid > 0) {
-    // close write pipe
-    close(pipefd[1]);
-    char buf[BUFSIZE];
-    if (-1 == read(pipefd[0], &buf, BUFSIZE)) {
-      perror("read error");
+  options.stations = stations;
+  double percentiles[64];
+  options.percentiles = percentiles;
+  while ((opt = getopt_long(argc, argv, "bc:e:fHk:m:ps:t:h", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      binary = 1;
+      break;
+    case 'B':
+      if (strcmp(optarg, "max") == 0) {
+        options.by = BRC_RANK_MAX;
+      } else if (strcmp(optarg, "mean") == 0) {
+        options.by = BRC_RANK_MEAN;
+      } else if (strcmp(optarg, "min") == 0) {
+        options.by = BRC_RANK_MIN;
+      } else {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'c': {
+      long n = parse_count(optarg, BRC_MAX_CURSORS);
+      if (n == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      options.cursors = (unsigned int)n;
+      break;
+    }
+    case 'e':
+      if (strcmp(optarg, "mmap") == 0) {
+        options.engine = BRC_ENGINE_MMAP;
+      } else if (strcmp(optarg, "uring") == 0) {
+        options.engine = BRC_ENGINE_URING;
+      } else {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'f':
+      options.per_file = 1;
+      break;
+    case 'H':
+      memory.huge_pages = 1;
+      break;
+    case 'k':
+      options.checkpoint = optarg;
+      break;
+    case 'I':
+      options.index = optarg;
+      break;
+    case 'R':
+      if (!parse_rows(optarg, &options.first_row, &options.last_row)) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'p':
+      options.pin = 1;
+      break;
+    case 'S':
+      options.pin = 2;
+      break;
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'N':
+      stations[options.nstations++] = optarg;
+      break;
+    case 'D':
+      options.stddev = 1;
+      break;
+    case 'P':
+      options.npercentiles = parse_percentiles(
+          optarg, percentiles, sizeof(percentiles) / sizeof(*percentiles));
+      if (options.npercentiles == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't': {
+      long n = parse_count(optarg, BRC_MAX_THREADS);
+      if (n == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      options.threads = (unsigned int)n;
+      break;
+    }
+    case 'T': {
+      long n = parse_count(optarg, UINT32_MAX);
+      if (n == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      options.top = (unsigned int)n;
+      break;
+    }
+    case 'm':
+      memory.limit = parse_size(optarg);
+      if (memory.limit == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+      usage();
+      exit(EXIT_SUCCESS);
+    default:
+      usage();
+      exit(EXIT_FAILURE);
     }
-    printf("%s", buf);
-    close(pipefd[0]);
+  }
+  if (binary && (options.per_file || socket_path || options.npercentiles ||
+                 options.stddev)) {
+    usage();
     exit(EXIT_FAILURE);
   }
-
-  // close unused read pipe
-  close(pipefd[0]);
-
-  char *file = "measurements.txt";
-  if (argc > 1) {
-    file = argv[1];
+  if ((options.first_row || options.last_row) && !options.index) {
+    usage();
+    exit(EXIT_FAILURE);
   }
 
-  int fd = open(file, O_RDONLY);
-  if (!fd) {
-    perror("error opening file");
-    exit(EXIT_FAILURE);
+  // files (or directories, or patterns) to process
+  static const char *const default_paths[] = {"measurements.txt"};
+  const char *const *paths = default_paths;
+  size_t npaths = 1;
+  if (optind < argc) {
+    paths = (const char *const *)&argv[optind];
+    npaths = (size_t)(argc - optind);
   }
 
-  struct stat sb;
-  if (fstat(fd, &sb) == -1) {
-    perror("error getting file size");
+  brc_set_memory(&memory);
+  if (socket_path) {
+    serve_options = options;
+    serve_paths = paths;
+    serve_npaths = npaths;
+    serve(socket_path);
+    return EXIT_SUCCESS;
+  }
+  struct brc *b = brc_new(&options);
+  if (!b) {
     exit(EXIT_FAILURE);
   }
 
-  // mmap entire file into memory
-  size_t sz = (size_t)sb.st_size;
-  char *data = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
-  if (data == MAP_FAILED) {
-    perror("error mmapping file");
+  // set-up pipes for communication
+  // then fork into child process which does the actual work
+  // this allows us to skip the time the system spends doing munmap
+  // the child sends its output through one pipe,
+  // then a single byte through the other to say it succeeded
+  int pipefd[2];
+  int statusfd[2];
+  if (pipe(pipefd) != 0 || pipe(statusfd) != 0) {
+    perror("pipe error");
     exit(EXIT_FAILURE);
   }
-
-  // distribute work among N worker threads
-  chunk_size = (sz / (2 * NTHREADS));
-  chunk_count = (sz / chunk_size - 1) + 1;
-  pthread_t workers[NTHREADS];
-  for (unsigned int i = 0; i < NTHREADS; i++) {
-    pthread_create(&workers[i], NULL, process_chunk, data);
+  pid_t pid;
+  pid = fork();
+  if (pid == -1) {
+    perror("fork error");
+    exit(EXIT_FAILURE);
   }
+  if (pid > 0) {
+    // close write pipes
+    close(pipefd[1]);
+    close(statusfd[1]);
+    if (!forward_output(pipefd[0])) {
+      exit(EXIT_FAILURE);
+    }
 
-  // wait for all threads to finish
-  struct Result *results[NTHREADS];
-  for (unsigned int i = 0; i < NTHREADS; i++) {
-    pthread_join(workers[i], (void *)&results[i]);
-  }
+    // no need to wait for the child to clean up once it reports success
+    char ok;
+    if (read(statusfd[0], &ok, 1) == 1) {
+      exit(EXIT_SUCCESS);
+    }
 
-  // merge results
-  struct Result *result = results[0];
-  for (unsigned int i = 1; i < NTHREADS; i++) {
-    for (unsigned int j = 0; j < results[i]->n; j++) {
-      struct Group *b = &results[i]->groups[j];
-      unsigned int *hm_entry = hashmap_entry(result, b->key);
-      unsigned int c = *hm_entry;
-      if (c == 0) {
-        c = result->n++;
-        *hm_entry = c;
-        strcpy(result->groups[c].key, b->key);
-      }
-      result->groups[c].count += b->count;
-      result->groups[c].sum += b->sum;
-      result->groups[c].min = min(result->groups[c].min, b->min);
-      result->groups[c].max = max(result->groups[c].max, b->max);
+    // otherwise it failed, pass on its exit status
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)) {
+      exit(EXIT_FAILURE);
     }
+    exit(WEXITSTATUS(status) != 0 ? WEXITSTATUS(status) : EXIT_FAILURE);
   }
 
-  // sort results alphabetically
-  qsort(result->groups, (size_t)result->n, sizeof(*result->groups), cmp);
+  // close unused read pipes
+  close(pipefd[0]);
+  close(statusfd[0]);
 
-  // prepare output string
-  char buf[(1 << 10) * 16];
-  result_to_str(buf, result);
-  if (-1 == write(pipefd[1], buf, strlen(buf))) {
-    perror("write error");
+  if (brc_aggregate_files(b, paths, npaths) != 0) {
+    exit(EXIT_FAILURE);
   }
 
-  // close write pipe
+  // hand output to the parent, then let it know we're done
+  if (options.per_file) {
+    hand_off_per_file(pipefd[1], b);
+  }
+  size_t len;
+  char *output =
+      brc_format(b, binary ? BRC_FORMAT_PARTIAL : BRC_FORMAT_TEXT, &len);
+  if (!output) {
+    exit(EXIT_FAILURE);
+  }
+  hand_off(pipefd[1], output, len);
   close(pipefd[1]);
+  if (write(statusfd[1], "", 1) != 1) {
+    perror("write error");
+  }
+  close(statusfd[1]);
 
   // clean-up
-  munmap((void *)data, sz);
-  close(fd);
-  for (unsigned int i = 0; i < NTHREADS; i++) {
-    free(results[i]);
-  }
+  // the output is left mapped, the pipe may still refer to its pages
+  brc_free(b);
   return EXIT_SUCCESS;
 }
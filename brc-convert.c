@@ -0,0 +1,148 @@
+// Converts a measurements file into the columnar format of columnar.h,
+// which analyze reads about 3-4 times less memory for
+//
+// Stations get their ids in order of appearance, using the same hashmap
+// as analyze; rows are collected a block at a time and written out as
+// a column of ids followed by a column of temperatures
+
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include "aggregate.h"
+#include "columnar.h"
+
+static uint16_t ids[COLUMNAR_BLOCK_ROWS];
+static int16_t temperatures[COLUMNAR_BLOCK_ROWS];
+
+static void write_block(FILE *f, size_t n) {
+  if (fwrite(ids, sizeof(*ids), n, f) != n ||
+      fwrite(temperatures, sizeof(*temperatures), n, f) != n) {
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: brc-convert input output\n"
+                  "  converts the measurements in input (- for stdin) into "
+                  "a columnar file\n");
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      usage();
+      exit(EXIT_SUCCESS);
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  const char *input = argv[optind];
+  FILE *in = strcmp(input, "-") == 0 ? stdin : fopen(input, "r");
+  if (!in) {
+    perror("error opening file");
+    exit(EXIT_FAILURE);
+  }
+  FILE *out = fopen(argv[optind + 1], "wb");
+  if (!out) {
+    perror("error opening output file");
+    exit(EXIT_FAILURE);
+  }
+
+  // rows start after the header, which is filled in once we're done
+  static const char padding[COLUMNAR_DATA_OFFSET];
+  if (fwrite(padding, sizeof(padding), 1, out) != 1) {
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+
+  struct Result *stations = result_new();
+  if (!stations) {
+    exit(EXIT_FAILURE);
+  }
+  uint64_t rows = 0;
+  size_t n = 0;
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, in)) != -1) {
+    if (len > 0 && line[len - 1] == '\n') {
+      len--;
+    }
+    if (len == 0) {
+      continue;
+    }
+    const char *semicolon = memchr(line, ';', (size_t)len);
+    int temperature;
+    if (!semicolon ||
+        !parse_tenths(semicolon + 1, (size_t)(line + len - semicolon - 1),
+                      &temperature)) {
+      fprintf(stderr, "invalid measurement in row %lu\n",
+              (unsigned long)(rows + 1));
+      exit(EXIT_FAILURE);
+    }
+
+    const unsigned int key_len = (unsigned int)(semicolon - line);
+    unsigned int id =
+        hashmap_entry(stations, line, key_len, hash_key(line, key_len));
+    if (out_of_memory) {
+      exit(EXIT_FAILURE);
+    }
+    if (id >= COLUMNAR_MAX_STATIONS) {
+      fprintf(stderr, "more than %d stations\n", COLUMNAR_MAX_STATIONS);
+      exit(EXIT_FAILURE);
+    }
+    ids[n] = (uint16_t)id;
+    temperatures[n] = (int16_t)temperature;
+    rows++;
+    if (++n == COLUMNAR_BLOCK_ROWS) {
+      write_block(out, n);
+      n = 0;
+    }
+  }
+  if (ferror(in)) {
+    perror("read error");
+    exit(EXIT_FAILURE);
+  }
+  write_block(out, n);
+
+  // the dictionary follows the last block
+  for (unsigned int i = 0; i < stations->n; i++) {
+    const uint32_t key_len = stations->keys[i].len;
+    fwrite(&key_len, sizeof(key_len), 1, out);
+    fwrite(group_key(stations, i), 1, key_len, out);
+  }
+
+  struct ColumnarHeader header = {
+      .magic = COLUMNAR_MAGIC,
+      .rows = rows,
+      .block_rows = COLUMNAR_BLOCK_ROWS,
+      .stations = stations->n,
+  };
+  header.dictionary = COLUMNAR_DATA_OFFSET + rows * 4;
+  if (fseek(out, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, out) != 1 || fclose(out) != 0) {
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "%lu rows, %u stations\n", (unsigned long)rows,
+          stations->n);
+  free(line);
+  result_free(stations);
+  fclose(in);
+  return EXIT_SUCCESS;
+}
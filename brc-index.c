@@ -0,0 +1,277 @@
+// Builds a sidecar index of a measurements file (see index.h), which lets
+// analyze --index aggregate a range of rows, or a few stations, without
+// parsing more than the two blocks at the edges of the range
+//
+// Stations get their ids in order of appearance, using the same hashmap
+// as analyze; the aggregates of every block are collected in an array
+// indexed by id, and appended to the groups of all blocks once it's done
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aggregate.h"
+#include "index.h"
+
+// Blocks, and the ids and aggregates of the stations of every block,
+// in order of id, back to back
+static struct IndexBlock *blocks;
+static uint64_t nblocks;
+static uint64_t blocks_capacity;
+static uint32_t *group_ids;
+static struct IndexGroup *groups;
+static uint64_t ngroups;
+static uint64_t groups_capacity;
+
+// Aggregates of every station in the current block, by id,
+// and the ids of those it has
+static struct IndexGroup *current;
+static unsigned int current_capacity;
+static uint32_t *touched;
+static unsigned int ntouched;
+
+static void *grow(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    perror("realloc error");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static int cmp_ids(const void *ptr_a, const void *ptr_b) {
+  const uint32_t a = *(const uint32_t *)ptr_a;
+  const uint32_t b = *(const uint32_t *)ptr_b;
+  return (a > b) - (a < b);
+}
+
+// adds a block of rows starting at offset, with the stations in current
+static void add_block(uint64_t offset, uint64_t first_row, uint64_t rows) {
+  if (nblocks == blocks_capacity) {
+    blocks_capacity = blocks_capacity ? blocks_capacity * 2 : 1024;
+    blocks = grow(blocks, blocks_capacity * sizeof(*blocks));
+  }
+  blocks[nblocks++] = (struct IndexBlock){
+      .offset = offset,
+      .first_row = first_row,
+      .rows = rows,
+      .groups = ngroups,
+  };
+
+  qsort(touched, ntouched, sizeof(*touched), cmp_ids);
+  if (ngroups + ntouched > groups_capacity) {
+    while (ngroups + ntouched > groups_capacity) {
+      groups_capacity = groups_capacity ? groups_capacity * 2 : 1 << 16;
+    }
+    group_ids = grow(group_ids, groups_capacity * sizeof(*group_ids));
+    groups = grow(groups, groups_capacity * sizeof(*groups));
+  }
+  for (unsigned int i = 0; i < ntouched; i++) {
+    group_ids[ngroups] = touched[i];
+    groups[ngroups++] = current[touched[i]];
+    current[touched[i]].count = 0;
+  }
+  ntouched = 0;
+}
+
+// adds a temperature to station id of the current block
+static void add_row(unsigned int id, int temperature) {
+  if (id >= current_capacity) {
+    unsigned int capacity = current_capacity ? current_capacity * 2 : 1024;
+    while (id >= capacity) {
+      capacity *= 2;
+    }
+    current = grow(current, capacity * sizeof(*current));
+    touched = grow(touched, capacity * sizeof(*touched));
+    memset(&current[current_capacity], 0,
+           (capacity - current_capacity) * sizeof(*current));
+    current_capacity = capacity;
+  }
+
+  struct IndexGroup *g = &current[id];
+  if (g->count == 0) {
+    *g = (struct IndexGroup){.min = INT16_MAX, .max = INT16_MIN};
+    touched[ntouched++] = id;
+  }
+  if (g->count == UINT32_MAX) {
+    fprintf(stderr, "too many rows for a single station in a block\n");
+    exit(EXIT_FAILURE);
+  }
+  g->count += 1;
+  g->sum += temperature;
+  g->min = (int16_t)min(g->min, temperature);
+  g->max = (int16_t)max(g->max, temperature);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: brc-index input output\n"
+                  "  writes an index of the measurements in input "
+                  "for analyze --index\n");
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'h':
+      usage();
+      exit(EXIT_SUCCESS);
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  // the index refers to rows by their offset, so it takes a regular file
+  const char *input = argv[optind];
+  int fd = open(input, O_RDONLY);
+  if (fd == -1) {
+    perror("error opening file");
+    exit(EXIT_FAILURE);
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    perror("error getting file size");
+    exit(EXIT_FAILURE);
+  }
+  if (!S_ISREG(sb.st_mode)) {
+    fprintf(stderr, "%s: not a regular file\n", input);
+    exit(EXIT_FAILURE);
+  }
+  const size_t size = (size_t)sb.st_size;
+  const char *data = NULL;
+  if (size > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("error mmapping file");
+      exit(EXIT_FAILURE);
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+  }
+
+  // every line belongs to the block it starts in
+  // blocks that no line starts in get no rows
+  struct Result *stations = result_new();
+  if (!stations) {
+    exit(EXIT_FAILURE);
+  }
+  uint64_t rows = 0;
+  uint64_t block = 0;
+  uint64_t block_offset = 0;
+  uint64_t block_rows = 0;
+  size_t offset = 0;
+  while (offset < size) {
+    for (; offset / INDEX_BLOCK_SIZE > block; block++) {
+      add_block(block_offset, rows - block_rows, block_rows);
+      block_offset = offset;
+      block_rows = 0;
+    }
+
+    const char *line = &data[offset];
+    const char *newline = memchr(line, '\n', size - offset);
+    const size_t len =
+        newline ? (size_t)(newline - line) : size - offset;
+    const char *semicolon = memchr(line, ';', len);
+    int temperature;
+    if (!semicolon ||
+        !parse_tenths(semicolon + 1, (size_t)(line + len - semicolon - 1),
+                      &temperature)) {
+      fprintf(stderr, "invalid measurement in row %lu\n",
+              (unsigned long)(rows + 1));
+      exit(EXIT_FAILURE);
+    }
+
+    const unsigned int key_len = (unsigned int)(semicolon - line);
+    const unsigned int id =
+        hashmap_entry(stations, line, key_len, hash_key(line, key_len));
+    if (out_of_memory) {
+      exit(EXIT_FAILURE);
+    }
+    add_row(id, temperature);
+    rows++;
+    block_rows++;
+    offset += len + 1;
+  }
+  const uint64_t total_blocks = (size + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+  for (; block < total_blocks; block++) {
+    add_block(block_offset, rows - block_rows, block_rows);
+    block_offset = size;
+    block_rows = 0;
+  }
+
+  struct IndexHeader header = {
+      .magic = INDEX_MAGIC,
+      .dev = (uint64_t)sb.st_dev,
+      .ino = (uint64_t)sb.st_ino,
+      .size = size,
+      .mtime_sec = (int64_t)sb.st_mtim.tv_sec,
+      .mtime_nsec = (int64_t)sb.st_mtim.tv_nsec,
+      .block_size = INDEX_BLOCK_SIZE,
+      .blocks = nblocks,
+      .rows = rows,
+      .stations = stations->n,
+      .groups = ngroups,
+  };
+  header.dictionary = index_groups(&header) + ngroups * sizeof(*groups);
+
+  FILE *out = fopen(argv[optind + 1], "wb");
+  if (!out) {
+    perror("error opening output file");
+    exit(EXIT_FAILURE);
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(blocks, sizeof(*blocks), nblocks, out);
+
+  // the bitmap of every block follows from the ids of its groups
+  const uint64_t words = index_words(&header);
+  uint64_t *bitmap = calloc(words ? words : 1, sizeof(*bitmap));
+  if (!bitmap) {
+    perror("malloc error");
+    exit(EXIT_FAILURE);
+  }
+  for (uint64_t i = 0; i < nblocks; i++) {
+    const uint64_t end = i + 1 < nblocks ? blocks[i + 1].groups : ngroups;
+    memset(bitmap, 0, words * sizeof(*bitmap));
+    for (uint64_t j = blocks[i].groups; j < end; j++) {
+      bitmap[group_ids[j] / 64] |= (uint64_t)1 << (group_ids[j] % 64);
+    }
+    fwrite(bitmap, sizeof(*bitmap), words, out);
+  }
+  fwrite(groups, sizeof(*groups), ngroups, out);
+
+  for (unsigned int i = 0; i < stations->n; i++) {
+    const uint32_t key_len = stations->keys[i].len;
+    fwrite(&key_len, sizeof(key_len), 1, out);
+    fwrite(group_key(stations, i), 1, key_len, out);
+  }
+  if (ferror(out) || fclose(out) != 0) {
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "%lu rows, %u stations, %lu blocks\n", (unsigned long)rows,
+          stations->n, (unsigned long)nblocks);
+  free(bitmap);
+  free(blocks);
+  free(group_ids);
+  free(groups);
+  free(current);
+  free(touched);
+  result_free(stations);
+  if (data) {
+    munmap((void *)data, size);
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}
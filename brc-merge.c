@@ -0,0 +1,169 @@
+// Merges files of partial aggregates, as written by `analyze --binary`,
+// into a single result, printed just like analyze prints it
+// (or as partial aggregates again, to be merged further)
+//
+// Files are read in parallel, every thread adding the ones it picks up to
+// its own hashmap, after which the threads merge their results pairwise
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "aggregate.h"
+
+// Upper limit for the number of threads
+#define MAX_THREADS 4096
+
+static char **files;
+static unsigned int nfiles;
+static atomic_uint next_file;
+
+static void *merge_files(void *_data) {
+  (void)_data;
+  struct Result *result = result_new();
+  if (!result) {
+    exit(EXIT_FAILURE);
+  }
+
+  // keep grabbing files until done
+  while (1) {
+    const unsigned int i = atomic_fetch_add(&next_file, 1);
+    if (i >= nfiles) {
+      break;
+    }
+    FILE *f = fopen(files[i], "rb");
+    if (!f) {
+      perror(files[i]);
+      exit(EXIT_FAILURE);
+    }
+    if (!read_partial(f, result)) {
+      // running out of memory was reported already
+      if (out_of_memory) {
+        exit(EXIT_FAILURE);
+      }
+      fprintf(stderr, "%s: not a file of partial aggregates\n", files[i]);
+      exit(EXIT_FAILURE);
+    }
+    fclose(f);
+  }
+
+  return (void *)merge_results(result);
+}
+
+// parses a whole number in [1, max], returns 0 if it's anything else
+static long parse_count(const char *s, long max) {
+  char *end;
+  errno = 0;
+  long n = strtol(s, &end, 10);
+  return end != s && *end == '\0' && errno == 0 && n >= 1 && n <= max ? n : 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: brc-merge [-b] [-t threads] file...\n"
+          "  -b, --binary           write partial aggregates instead of "
+          "text\n"
+          "  -t, --threads N        number of threads "
+          "(1-%d, default: number of CPUs)\n",
+          MAX_THREADS);
+}
+
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"binary", no_argument, NULL, 'b'},
+      {"threads", required_argument, NULL, 't'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  int binary = 0;
+  long nthreads = available_cpus();
+  while ((opt = getopt_long(argc, argv, "bt:h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      binary = 1;
+      break;
+    case 't':
+      nthreads = parse_count(optarg, MAX_THREADS);
+      if (nthreads == 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+      usage();
+      exit(EXIT_SUCCESS);
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  files = &argv[optind];
+  nfiles = (unsigned int)(argc - optind);
+
+  // no point in having more threads than files
+  unsigned int n = (unsigned int)nthreads;
+  if (n > nfiles) {
+    n = nfiles;
+  }
+  pthread_t *workers = malloc(n * sizeof(*workers));
+  struct Result **results = malloc(n * sizeof(*results));
+  if (!workers || !results) {
+    perror("malloc error");
+    exit(EXIT_FAILURE);
+  }
+  atomic_init(&results_left, n);
+  for (unsigned int i = 0; i < n; i++) {
+    const int err = pthread_create(&workers[i], NULL, merge_files, NULL);
+    if (err != 0) {
+      errno = err;
+      perror("pthread_create error");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    pthread_join(workers[i], (void *)&results[i]);
+  }
+  if (atomic_load(&merge_failed)) {
+    exit(EXIT_FAILURE);
+  }
+
+  // one of the threads returned the final result
+  struct Result *result = NULL;
+  for (unsigned int i = 0; i < n; i++) {
+    if (results[i]) {
+      result = results[i];
+    }
+  }
+
+  if (binary) {
+    write_partial(stdout, result);
+  } else {
+    struct Entry *entries = sorted_entries(result);
+    size_t len;
+    char *output = entries ? format_results(result, entries, result->n, NULL,
+                                            0, &len)
+                           : NULL;
+    if (!output) {
+      exit(EXIT_FAILURE);
+    }
+    fwrite(output, 1, len, stdout);
+    munmap(output, len);
+    free(entries);
+  }
+  if (fflush(stdout) != 0) {
+    perror("write error");
+    exit(EXIT_FAILURE);
+  }
+
+  result_free(result);
+  free(results);
+  free(workers);
+  return EXIT_SUCCESS;
+}
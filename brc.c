@@ -0,0 +1,3018 @@
+// The aggregation engine behind analyze, see brc.h
+//
+// Files are mapped into memory (or streamed, if they can't be) and split
+// into chunks, which a pool of worker threads claims and parses into
+// hashmaps of their own. The workers merge their results as they finish.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "aggregate.h"
+#include "brc.h"
+#include "columnar.h"
+#include "index.h"
+#include "parse_number.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Number of readable (zeroed) bytes mapped past the end of the file
+// so that the hot loop can load whole words without bounds checks
+#define MMAP_PADDING 4096
+
+// Lines that start this close to the end of a pushed buffer
+// are parsed from a padded copy instead
+#define BUFFER_SLACK 64
+
+// Filesystem magic numbers, as in linux/magic.h
+#define TMPFS_MAGIC 0x01021994
+#define HUGETLBFS_MAGIC 0x958458f6
+
+// Size of the buffers used when streaming from a pipe, stdin or io_uring
+// a single line may not be longer than this
+// (linux/fs.h, pulled in by io_uring.h, has a BLOCK_SIZE of its own)
+#undef BLOCK_SIZE
+#define BLOCK_SIZE ((1 << 20) * 4)
+
+// Most blocks streamed at once, however many threads there are:
+// enough to keep the workers and the reader busy, past that the extra
+// buffers only cost memory (and page faults to set them up)
+#define MAX_BLOCKS 16
+
+// Extra bytes read past the end of every block by the io_uring engine
+// so that the last line of a block is complete without the next read
+// a single line may not be longer than this
+#define READ_OVERLAP ((1 << 10) * 64)
+
+// Number of lines each thread processes in lockstep
+// and number of worker threads, for the files being aggregated
+static unsigned int ncursors;
+static unsigned int nthreads;
+
+// The file is scheduled in chunks of this size
+// workers claim runs of chunks, starting big and shrinking towards the end
+#define CHUNK_SIZE ((size_t)(1 << 20) * 2)
+
+// A station of a columnar file, looked up by its id
+struct Station {
+  const char *key;
+  uint32_t len;
+  unsigned int hash;
+};
+
+// The stations to aggregate, if not all of them: a small open-addressing
+// set on the hash scan_key computes anyway, so that rows of other stations
+// are dropped before they get to the hashmap
+struct StationSet {
+  struct Station *slots;
+  unsigned int mask;
+};
+// (the set of the call to brc_aggregate_files in progress, or NULL)
+static const struct StationSet *station_set;
+
+// Whether the results of the call to brc_aggregate_files in progress
+// keep histograms, for percentiles, and sums of squares, for the variance
+static int keep_histograms = 0;
+static int keep_squares = 0;
+
+// A file to process: [start, size) of its mapping at data, if mapped
+// its chunks are numbered from first_chunk, after those of the files before it
+// columnar files have one chunk per block, and a dictionary of stations
+// st is what the file looked like when it was read
+// a last line without a newline is left out of the chunks: the tail bytes
+// past size, parsed from a padded copy by process_tail
+struct Input {
+  const char *path;
+  struct stat st;
+  char *data;
+  size_t start;
+  size_t size;
+  size_t tail;
+  size_t mapped;
+  unsigned int first_chunk;
+  const struct ColumnarHeader *columnar;
+  struct Station *stations;
+};
+// (the files of the call to brc_aggregate_files in progress)
+static struct Input *inputs;
+static unsigned int ninputs;
+static size_t chunk_count;
+
+// With per_file, workers keep a result for every file they touch
+// file_results[w][i] (NULL if worker w got no chunk of file i)
+static int per_file = 0;
+static struct Result ***file_results;
+
+// Set by a worker or the reader once it runs into bad input (reported on
+// stderr), which makes the others stop and the call fail
+static atomic_bool input_failed;
+
+// NUMA topology, read from /sys/devices/system/node
+// a single node if there is no such thing
+#define MAX_NODES 64
+static unsigned int nnodes = 1;
+static unsigned char cpu_nodes[CPU_SETSIZE];
+
+// All chunks, grouped by the NUMA node their pages live on
+// and every node's share of them: chunk_order[next..end)
+static unsigned int *chunk_order;
+struct ChunkQueue {
+  atomic_uint next;
+  unsigned int end;
+};
+static struct ChunkQueue chunk_queues[MAX_NODES];
+
+// The chunks a worker has claimed but not started yet,
+// chunk_order[next..end) packed as end << 32 | next so that both
+// the worker and thieves can take chunks with a single atomic operation
+struct WorkerRange {
+  _Alignas(64) atomic_uint_least64_t range;
+};
+static struct WorkerRange *worker_ranges;
+
+// CPUs to pin worker threads to, none if pinning is off
+static unsigned int pin_cpus[CPU_SETSIZE];
+static unsigned int npins = 0;
+
+// A buffer of whole lines, handed from the reader to the workers
+// when not processing a memory-mapped file
+// (the lines don't necessarily start at the beginning of the buffer)
+struct Block {
+  char *buf;
+  char *data;
+  size_t len;
+};
+
+// Bounded lock-free queue of blocks
+// every cell carries a sequence number that tells producers and
+// consumers whether it's their turn, so the only contended operation
+// is a compare-and-swap on the head or tail position
+struct Queue {
+  struct Cell {
+    atomic_size_t seq;
+    struct Block block;
+  } *cells;
+  size_t mask;
+  atomic_size_t head;
+  atomic_size_t tail;
+};
+
+static inline uint64_t load64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// returns a word with the high bit set in the lowest byte equal to ';'
+// (higher bytes may contain false positives, so only use the lowest set bit)
+static inline uint64_t semicolon_mask(uint64_t word) {
+  uint64_t x = word ^ 0x3B3B3B3B3B3B3B3BULL;
+  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+// finds the position of ';' in the line starting at s
+// while simultaneously hashing everything up to that point
+static inline unsigned int scan_key(const char *s, unsigned int *hash) {
+#ifdef USE_SWAR
+  // look at the first 16 bytes as two words
+  // which covers the vast majority of keys without a loop
+  uint64_t w0 = load64(s);
+  uint64_t w1 = load64(s + 8);
+  uint64_t m0 = semicolon_mask(w0);
+  uint64_t m1 = semicolon_mask(w1);
+
+  if ((m0 | m1) != 0) {
+    // (m ^ (m - 1)) >> 8 keeps all bytes below the ';'
+    uint64_t k0 = m0 ? (m0 ^ (m0 - 1)) >> 8 : ~0ULL;
+    uint64_t k1 = m0 ? 0 : (m1 ^ (m1 - 1)) >> 8;
+    *hash = hash_words(w0 & k0, w1 & k1);
+    return m0 ? (unsigned int)__builtin_ctzll(m0) >> 3
+              : 8 + ((unsigned int)__builtin_ctzll(m1) >> 3);
+  }
+
+  unsigned int len = 16;
+  while (s[len] != ';') {
+    len++;
+  }
+  *hash = hash_words(w0, w1);
+  return len;
+#else
+  unsigned int len = 0;
+  while (s[len] != ';') {
+    len++;
+  }
+  *hash = hash_key(s, len);
+  return len;
+#endif
+}
+
+// returns whether the key of len bytes at s, with hash h, is in set
+static inline int station_set_contains(const struct StationSet *set,
+                                       const char *s, unsigned int len,
+                                       unsigned int h) {
+  for (unsigned int i = h & set->mask; set->slots[i].key;
+       i = (i + 1) & set->mask) {
+    const struct Station *st = &set->slots[i];
+    if (st->hash == h && st->len == len && memcmp(st->key, s, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// adds a temperature to group c, and to its histogram and sum of squares
+// if result keeps those and extra is set
+static inline __attribute__((always_inline)) void
+group_add(struct Result *result, unsigned int c, int temperature, int extra) {
+  struct Group *g = &result->groups[c];
+  g->count += 1;
+  g->min = (int16_t)min(g->min, temperature);
+  g->max = (int16_t)max(g->max, temperature);
+  g->sum += temperature;
+  if (extra) {
+    if (result->hist) {
+      hist_add(result, c, temperature);
+    }
+    if (result->squares) {
+      result->squares[c] += (uint64_t)(temperature * temperature);
+    }
+  }
+}
+
+// parses a single line and adds it to the result
+// returns a pointer to the start of the next line
+static inline const char *process_line(struct Result *result, const char *s) {
+  const char *linestart = s;
+
+  // find position of ;
+  // while simulatenuously hashing everything up to that point
+  unsigned int h;
+  unsigned int len = scan_key(s, &h);
+
+  // parse decimal number as int
+  int temperature;
+  s = parse_number(&temperature, linestart + len + 1);
+
+  // find (or create) group for this key
+  unsigned int c = hashmap_entry(result, linestart, len, h);
+  group_add(result, c, temperature, 0);
+
+  return s;
+}
+
+// like process_line, but skipping lines of stations not in set (if any)
+// and adding to the histograms and sums of squares as well, if kept
+// (kept apart so that the plain hot loop stays as it is)
+static const char *process_line_with(struct Result *result, const char *s,
+                                     const struct StationSet *set) {
+  const char *linestart = s;
+  unsigned int h;
+  unsigned int len = scan_key(s, &h);
+  int temperature;
+  s = parse_number(&temperature, linestart + len + 1);
+  if (set && !station_set_contains(set, linestart, len, h)) {
+    return s;
+  }
+
+  unsigned int c = hashmap_entry(result, linestart, len, h);
+  group_add(result, c, temperature, 1);
+  return s;
+}
+
+// advances n cursors one line at a time in lockstep
+// until one of them reaches the end of its range
+// the lines are independent of each other, so the cpu can overlap
+// parsing one line with waiting on the hashmap slot of another
+static inline __attribute__((always_inline)) void
+process_lockstep(struct Result *result, const char **cursors,
+                 const char **ends, unsigned int n,
+                 const struct StationSet *set, int extra) {
+  while (1) {
+    for (unsigned int i = 0; i < n; i++) {
+      if (cursors[i] == ends[i]) {
+        return;
+      }
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+      cursors[i] = extra ? process_line_with(result, cursors[i], set)
+                         : process_line(result, cursors[i]);
+    }
+  }
+}
+
+// processes all lines in [s, end)
+// by splitting the range into n newline-aligned sub-ranges
+static inline __attribute__((always_inline)) void
+process_range_in(struct Result *result, const char *s, const char *end,
+                 unsigned int n, const struct StationSet *set, int extra) {
+  const char *cursors[BRC_MAX_CURSORS];
+  const char *ends[BRC_MAX_CURSORS];
+  const size_t step = (size_t)(end - s) / n;
+
+  cursors[0] = s;
+  for (unsigned int i = 1; i < n; i++) {
+    const char *p = cursors[i - 1] + step;
+    cursors[i] = p < end ? (char *)memchr(p, '\n', (size_t)(end - p)) + 1 : end;
+    ends[i - 1] = cursors[i];
+  }
+  ends[n - 1] = end;
+
+  // dispatch on a constant cursor count for the common values
+  // so that the compiler can fully unroll the lockstep loop
+  switch (n) {
+  case 1:
+    break;
+  case 2:
+    process_lockstep(result, cursors, ends, 2, set, extra);
+    break;
+  case 4:
+    process_lockstep(result, cursors, ends, 4, set, extra);
+    break;
+  case 8:
+    process_lockstep(result, cursors, ends, 8, set, extra);
+    break;
+  default:
+    process_lockstep(result, cursors, ends, n, set, extra);
+    break;
+  }
+
+  // flaming hot loop
+  // finish whatever is left in each sub-range
+  for (unsigned int i = 0; i < n; i++) {
+    while (cursors[i] != ends[i]) {
+      cursors[i] = extra ? process_line_with(result, cursors[i], set)
+                         : process_line(result, cursors[i]);
+    }
+  }
+}
+
+// processes all lines in [s, end) of the stations in set (if not NULL)
+// without a set, histograms or sums of squares, their checks are compiled
+// out of the hot loop
+static void process_range(struct Result *result, const char *s,
+                          const char *end, unsigned int n,
+                          const struct StationSet *set) {
+  if (set || result->hist || result->squares) {
+    process_range_in(result, s, end, n, set, 1);
+  } else {
+    process_range_in(result, s, end, n, NULL, 0);
+  }
+}
+
+// returns the NUMA node of the CPU the calling thread runs on
+static unsigned int current_node(void) {
+  int cpu = sched_getcpu();
+  return nnodes > 1 && cpu >= 0 && cpu < CPU_SETSIZE ? cpu_nodes[cpu] : 0;
+}
+
+static inline uint64_t pack_range(unsigned int next, unsigned int end) {
+  return (uint64_t)end << 32 | next;
+}
+
+// claims the next chunk for worker w, which runs on the given node
+// returns 0 once there is no work left anywhere
+static int claim_chunk(unsigned int w, unsigned int node, unsigned int *chunk) {
+  atomic_uint_least64_t *own = &worker_ranges[w].range;
+
+  while (1) {
+    // take the next chunk of our own range
+    // (this only contends with thieves, if any)
+    uint64_t r = atomic_fetch_add(own, 1);
+    if ((uint32_t)r < (uint32_t)(r >> 32)) {
+      *chunk = chunk_order[(uint32_t)r];
+      return 1;
+    }
+
+    // claim a new range: a share of what's left, so ranges start out big
+    // and get smaller towards the end
+    // our own node first, then the other nodes
+    int claimed = 0;
+    for (unsigned int k = 0; k < nnodes && !claimed; k++) {
+      struct ChunkQueue *queue = &chunk_queues[(node + k) % nnodes];
+      unsigned int i = atomic_load(&queue->next);
+      while (i < queue->end && !claimed) {
+        unsigned int n = (queue->end - i) / (2 * nthreads);
+        n = n > 0 ? n : 1;
+        if (atomic_compare_exchange_weak(&queue->next, &i, i + n)) {
+          atomic_store(own, pack_range(i, i + n));
+          claimed = 1;
+        }
+      }
+    }
+    if (claimed) {
+      continue;
+    }
+
+    // nothing left to claim, steal the second half of the biggest range
+    unsigned int victim = w;
+    unsigned int most = 0;
+    for (unsigned int v = 0; v < nthreads; v++) {
+      uint64_t vr = atomic_load(&worker_ranges[v].range);
+      uint32_t next = (uint32_t)vr, end = (uint32_t)(vr >> 32);
+      if (v != w && next < end && end - next > most) {
+        most = end - next;
+        victim = v;
+      }
+    }
+    if (victim == w) {
+      return 0;
+    }
+    r = atomic_load(&worker_ranges[victim].range);
+    uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+    if (next < end) {
+      uint32_t mid = next + (end - next) / 2;
+      if (atomic_compare_exchange_strong(&worker_ranges[victim].range, &r,
+                                         pack_range(next, mid))) {
+        atomic_store(own, pack_range(mid, end));
+      }
+    }
+  }
+}
+
+// returns the index of the file chunk belongs to
+static unsigned int chunk_input(unsigned int chunk) {
+  unsigned int lo = 0, hi = ninputs - 1;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo + 1) / 2;
+    if (inputs[mid].first_chunk <= chunk) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// returns the offset of chunk in its file
+static inline size_t chunk_offset(const struct Input *in, unsigned int chunk) {
+  if (in->columnar) {
+    return (size_t)columnar_block(in->columnar, chunk - in->first_chunk);
+  }
+  return in->start + (chunk - in->first_chunk) * CHUNK_SIZE;
+}
+
+// adds n rows of a columnar block to stats, indexed by station id
+// no hashing or parsing, just a load of both columns and an update
+//
+// with SSE2, a group is updated as a single 16-byte vector: the sum and
+// the count (with min and max above it) in one 64-bit add each, then
+// min and max of the top two 16-bit lanes, padded with values that
+// leave the other lanes alone
+static void process_columns(struct Group *stats, uint64_t *squares,
+                            const uint16_t *ids, const int16_t *temperatures,
+                            size_t n) {
+#ifdef __SSE2__
+  const __m128i min_mask = _mm_set_epi16(0, -1, 0, 0, 0, 0, 0, 0);
+  const __m128i max_mask = _mm_set_epi16(-1, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i min_pad =
+      _mm_andnot_si128(min_mask, _mm_set1_epi16(INT16_MAX));
+  const __m128i max_pad =
+      _mm_andnot_si128(max_mask, _mm_set1_epi16(INT16_MIN));
+  for (size_t i = 0; i < n; i++) {
+    __m128i *g = (__m128i *)&stats[ids[i]];
+    const int temperature = temperatures[i];
+    const __m128i t = _mm_set1_epi16((short)temperature);
+    __m128i v = _mm_loadu_si128(g);
+    v = _mm_add_epi64(v, _mm_set_epi64x(1, temperature));
+    v = _mm_min_epi16(v, _mm_or_si128(min_pad, _mm_and_si128(t, min_mask)));
+    v = _mm_max_epi16(v, _mm_or_si128(max_pad, _mm_and_si128(t, max_mask)));
+    _mm_storeu_si128(g, v);
+  }
+#else
+  for (size_t i = 0; i < n; i++) {
+    struct Group *g = &stats[ids[i]];
+    const int temperature = temperatures[i];
+    g->count += 1;
+    g->min = (int16_t)min(g->min, temperature);
+    g->max = (int16_t)max(g->max, temperature);
+    g->sum += temperature;
+  }
+#endif
+
+  // sums of squares (if kept) get a pass of their own,
+  // so that the one above stays as it is without them
+  if (squares) {
+    for (size_t i = 0; i < n; i++) {
+      squares[ids[i]] += (uint64_t)(temperatures[i] * temperatures[i]);
+    }
+  }
+}
+
+// adds the stats of the stations of a columnar file to result,
+// which should add up to the given number of rows,
+// and empties them for the next file
+// with a station filter, only those in the set are added: the rows of a
+// block are cheaper to update all at once than to check one by one
+static void fold_stations(struct Result *result, const struct Input *in,
+                          struct Group *stats, uint64_t *squares,
+                          uint64_t rows) {
+  uint64_t total = 0;
+  for (unsigned int id = 0; id < in->columnar->stations; id++) {
+    struct Group *g = &stats[id];
+    if (g->count == 0) {
+      continue;
+    }
+    total += g->count;
+    const struct Station *st = &in->stations[id];
+    if (station_set &&
+        !station_set_contains(station_set, st->key, st->len, st->hash)) {
+      *g = (struct Group){.min = INT16_MAX, .max = INT16_MIN};
+      if (squares) {
+        squares[id] = 0;
+      }
+      continue;
+    }
+    unsigned int c = hashmap_entry(result, st->key, st->len, st->hash);
+    if (!group_merge(&result->groups[c], g)) {
+      atomic_store(&input_failed, 1);
+    }
+    *g = (struct Group){.min = INT16_MAX, .max = INT16_MIN};
+    if (squares) {
+      result->squares[c] += squares[id];
+      squares[id] = 0;
+    }
+  }
+
+  // ids past the dictionary end up in stats nobody looks at
+  if (total != rows) {
+    fprintf(stderr, "%s: station id out of range\n", in->path);
+    atomic_store(&input_failed, 1);
+  }
+}
+
+// a group index for station ids that aren't looked up yet, and one for those
+// the station filter leaves out
+#define GROUP_UNKNOWN UINT32_MAX
+#define GROUP_SKIPPED (UINT32_MAX - 1)
+
+// adds the rows of a block of a columnar file to result and its histograms,
+// one at a time, with the group of every station id of the file in groups
+// (histograms are too big to keep for every possible station id)
+static void process_columns_hist(struct Result *result, uint32_t *groups,
+                                 const struct Input *in, const uint16_t *ids,
+                                 const int16_t *temperatures, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    const unsigned int id = ids[i];
+    const int temperature = temperatures[i];
+    if (id >= in->columnar->stations || temperature < -HIST_OFFSET ||
+        temperature > HIST_OFFSET) {
+      fprintf(stderr, "%s: station id or temperature out of range\n",
+              in->path);
+      atomic_store(&input_failed, 1);
+      return;
+    }
+    if (groups[id] == GROUP_UNKNOWN) {
+      const struct Station *st = &in->stations[id];
+      groups[id] =
+          station_set &&
+                  !station_set_contains(station_set, st->key, st->len,
+                                        st->hash)
+              ? GROUP_SKIPPED
+              : hashmap_entry(result, st->key, st->len, st->hash);
+    }
+    if (groups[id] != GROUP_SKIPPED) {
+      group_add(result, groups[id], temperature, 1);
+    }
+  }
+}
+
+// parses the last line of in if it has no newline, from a padded copy,
+// as the parser reads up to the next newline (and a little past it)
+// without memory for the copy, the line is left out (see out_of_memory)
+static void process_tail(struct Result *result, const struct Input *in) {
+  if (in->tail == 0) {
+    return;
+  }
+  char *copy = calloc(1, in->tail + 1 + MMAP_PADDING);
+  if (!copy) {
+    perror("malloc error");
+    out_of_memory = 1;
+    return;
+  }
+  memcpy(copy, &in->data[in->size], in->tail);
+  copy[in->tail] = '\n';
+  process_range(result, copy, &copy[in->tail + 1], 1, station_set);
+  free(copy);
+}
+
+// returns a new result, keeping histograms and sums of squares if asked to
+// or NULL if there's no memory for it
+static struct Result *new_result(void) {
+  struct Result *result = result_new();
+  if (result && ((keep_histograms && !result_keep_histograms(result)) ||
+                 (keep_squares && !result_keep_squares(result)))) {
+    result_free(result);
+    return NULL;
+  }
+  return result;
+}
+
+// returns whether this worker ran out of memory, in which case the run
+// fails just like it does on bad input, and everyone else stops early
+static int worker_out_of_memory(void) {
+  if (out_of_memory) {
+    atomic_store(&input_failed, 1);
+  }
+  return out_of_memory;
+}
+
+static void *process_chunk(void *arg) {
+  const unsigned int w = (unsigned int)(uintptr_t)arg;
+  // the thread may have run out of memory in an earlier run
+  out_of_memory = 0;
+
+  // initialize result
+  // this first touches the tables, so they end up on this thread's node
+  struct Result *result = new_result();
+  struct Result **own_results = NULL;
+  if (per_file) {
+    own_results = calloc(ninputs, sizeof(*own_results));
+    if (!own_results) {
+      perror("malloc error");
+      out_of_memory = 1;
+    }
+    file_results[w] = own_results;
+  }
+
+  // stats of every possible station id of the columnar file we're on
+  struct Group *stats = NULL;
+  const size_t stats_size = COLUMNAR_MAX_STATIONS * sizeof(*stats);
+  unsigned int stats_input = ninputs;
+  struct Result *stats_result = NULL;
+  uint64_t stats_rows = 0;
+
+  // along with their sums of squares, if kept
+  uint64_t *squares = NULL;
+  const size_t squares_size = COLUMNAR_MAX_STATIONS * sizeof(*squares);
+
+  // or with histograms, the group of every station id of that file
+  uint32_t *groups = NULL;
+  const size_t groups_size = COLUMNAR_MAX_STATIONS * sizeof(*groups);
+
+  // keep grabbing chunks until done, or until the input turns out bad
+  const unsigned int node = current_node();
+  unsigned int chunk;
+  while (!worker_out_of_memory() &&
+         !atomic_load_explicit(&input_failed, memory_order_relaxed) &&
+         claim_chunk(w, node, &chunk)) {
+    const unsigned int i = chunk_input(chunk);
+    const struct Input *in = &inputs[i];
+    const char *data = in->data;
+    struct Result *r = result;
+    if (per_file) {
+      if (!own_results[i]) {
+        own_results[i] = new_result();
+      }
+      r = own_results[i];
+      if (!r) {
+        continue;
+      }
+    }
+
+    if (in->columnar) {
+      const struct ColumnarHeader *h = in->columnar;
+      const uint64_t block = chunk - in->first_chunk;
+      const uint64_t first = block * h->block_rows;
+      const size_t n = (size_t)(h->rows - first < h->block_rows
+                                    ? h->rows - first
+                                    : h->block_rows);
+      const uint16_t *ids = (const uint16_t *)&data[columnar_block(h, block)];
+      const int16_t *temperatures = (const int16_t *)&ids[n];
+
+      if (keep_histograms) {
+        if (i != stats_input || r != stats_result) {
+          if (!groups) {
+            groups = table_realloc(NULL, 0, groups_size);
+            if (!groups) {
+              continue;
+            }
+          }
+          memset(groups, 0xFF, groups_size);
+          stats_input = i;
+          stats_result = r;
+        }
+        process_columns_hist(r, groups, in, ids, temperatures, n);
+        continue;
+      }
+
+      if (i != stats_input) {
+        if (stats) {
+          fold_stations(stats_result, &inputs[stats_input], stats, squares,
+                        stats_rows);
+        } else {
+          stats = table_realloc(NULL, 0, stats_size);
+          if (keep_squares) {
+            squares = table_realloc(NULL, 0, squares_size);
+          }
+          if (!stats || (keep_squares && !squares)) {
+            table_free(stats, stats_size);
+            table_free(squares, squares_size);
+            stats = NULL;
+            squares = NULL;
+            continue;
+          }
+          for (unsigned int id = 0; id < COLUMNAR_MAX_STATIONS; id++) {
+            stats[id] = (struct Group){.min = INT16_MAX, .max = INT16_MIN};
+          }
+          if (squares) {
+            memset(squares, 0, squares_size);
+          }
+        }
+        stats_input = i;
+        stats_result = r;
+        stats_rows = 0;
+      }
+      process_columns(stats, squares, ids, temperatures, n);
+      stats_rows += n;
+      continue;
+    }
+
+    size_t chunk_start = chunk_offset(in, chunk);
+    size_t chunk_end = chunk_start + CHUNK_SIZE;
+
+    // skip forward to next newline in chunk
+    // a line may span several chunks, so search up to the end of the file
+    const char *s = &data[chunk_start];
+    if (chunk_start > in->start) {
+      s = memchr(s, '\n', in->size - chunk_start);
+      s = s ? s + 1 : &data[in->size];
+    }
+
+    // this assumes the file ends in a newline...
+    const char *end = &data[in->size];
+    if (chunk_end < in->size) {
+      end = memchr(&data[chunk_end], '\n', in->size - chunk_end);
+      end = end ? end + 1 : &data[in->size];
+    }
+
+    if (s < end) {
+      process_range(r, s, end, ncursors, station_set);
+    }
+  }
+  if (stats) {
+    fold_stations(stats_result, &inputs[stats_input], stats, squares,
+                  stats_rows);
+    table_free(stats, stats_size);
+  }
+  if (squares) {
+    table_free(squares, squares_size);
+  }
+  if (groups) {
+    table_free(groups, groups_size);
+  }
+
+  worker_out_of_memory();
+  return (void *)merge_results(result);
+}
+
+// the queue must have room for capacity (a power of 2) blocks
+// returns -1 if there's no memory for it
+static int queue_init(struct Queue *q, size_t capacity) {
+  q->cells = malloc(capacity * sizeof(*q->cells));
+  if (!q->cells) {
+    perror("malloc error");
+    return -1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&q->cells[i].seq, i);
+  }
+  q->mask = capacity - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return 0;
+}
+
+// returns 0 if the queue is full
+static int queue_push(struct Queue *q, struct Block block) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  while (1) {
+    struct Cell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->block = block;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 1;
+      }
+    } else if (seq < pos) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+}
+
+// returns 0 if the queue is empty
+static int queue_pop(struct Queue *q, struct Block *block) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  while (1) {
+    struct Cell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *block = cell->block;
+        atomic_store_explicit(&cell->seq, pos + q->mask + 1,
+                              memory_order_release);
+        return 1;
+      }
+    } else if (seq < pos + 1) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+}
+
+// blocks filled by the reader and blocks free to be filled again
+static struct Queue filled_blocks;
+static struct Queue free_blocks;
+static atomic_bool reader_done;
+
+// threads waiting for a block sleep on these: the workers until a block is
+// filled (or the reader is done), the reader until one is free again
+// the queues themselves stay lock-free, the lock is only taken to wait
+// and to wake up whoever waits
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blocks_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t blocks_freed = PTHREAD_COND_INITIALIZER;
+
+// pushes block onto q (which has room for all of them)
+// and wakes up a thread waiting on cond for it
+static void push_block(struct Queue *q, pthread_cond_t *cond,
+                       struct Block block) {
+  queue_push(q, block);
+  pthread_mutex_lock(&blocks_lock);
+  pthread_cond_signal(cond);
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+// returns 0 once the reader is done and every filled block is taken
+static int next_filled_block(struct Block *block) {
+  if (queue_pop(&filled_blocks, block)) {
+    return 1;
+  }
+  pthread_mutex_lock(&blocks_lock);
+  int found;
+  // reader_done is only set under the lock, after the last push
+  while (!(found = queue_pop(&filled_blocks, block)) &&
+         !atomic_load(&reader_done)) {
+    pthread_cond_wait(&blocks_filled, &blocks_lock);
+  }
+  pthread_mutex_unlock(&blocks_lock);
+  return found;
+}
+
+// lets the workers know no more blocks will be filled
+static void finish_reading(void) {
+  pthread_mutex_lock(&blocks_lock);
+  atomic_store(&reader_done, 1);
+  pthread_cond_broadcast(&blocks_filled);
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+static void *process_blocks(void *_data) {
+  (void)_data;
+  out_of_memory = 0;
+  struct Result *result = new_result();
+  struct Block block;
+
+  // once out of memory, blocks are still taken and given back,
+  // so that the reader isn't left waiting for them
+  while (next_filled_block(&block)) {
+    if (!worker_out_of_memory()) {
+      process_range(result, block.data, block.data + block.len, ncursors,
+                    station_set);
+    }
+    push_block(&free_blocks, &blocks_freed, block);
+  }
+
+  worker_out_of_memory();
+  return (void *)merge_results(result);
+}
+
+// waits for a worker to give back a block if none is free
+static char *next_free_block(void) {
+  struct Block block;
+  if (queue_pop(&free_blocks, &block)) {
+    return block.buf;
+  }
+  pthread_mutex_lock(&blocks_lock);
+  while (!queue_pop(&free_blocks, &block)) {
+    pthread_cond_wait(&blocks_freed, &blocks_lock);
+  }
+  pthread_mutex_unlock(&blocks_lock);
+  return block.buf;
+}
+
+// frees the blocks, which all end up back in the free queue, and the queues
+static void blocks_free(void) {
+  struct Block block;
+  while (queue_pop(&free_blocks, &block)) {
+    free(block.buf);
+  }
+  free(filled_blocks.cells);
+  free(free_blocks.cells);
+}
+
+// sets up the queues, with nblocks free blocks
+// buffers are page-aligned and sized in whole pages for O_DIRECT
+// returns -1 if there's no memory for them
+static int blocks_init(size_t nblocks) {
+  size_t capacity = 1;
+  while (capacity < nblocks) {
+    capacity *= 2;
+  }
+  if (queue_init(&filled_blocks, capacity) != 0) {
+    return -1;
+  }
+  if (queue_init(&free_blocks, capacity) != 0) {
+    free(filled_blocks.cells);
+    return -1;
+  }
+  atomic_store(&reader_done, 0);
+  for (size_t i = 0; i < nblocks; i++) {
+    char *buf = aligned_alloc(4096, BLOCK_SIZE + READ_OVERLAP + MMAP_PADDING);
+    if (!buf) {
+      perror("malloc error");
+      blocks_free();
+      return -1;
+    }
+    queue_push(&free_blocks, (struct Block){.buf = buf});
+  }
+  return 0;
+}
+
+// reads fd until EOF, handing off newline-aligned blocks to the workers
+// the partial line at the end of every read is carried over to the next block
+// stops early (setting input_failed) on a read error or an overlong line
+static void read_blocks(int fd) {
+#ifdef F_SETPIPE_SZ
+  // a bigger pipe buffer means fewer wake-ups for the writing side
+  fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+#endif
+
+  char *buf = next_free_block();
+  size_t used = 0;
+  int eof = 0;
+
+  while (!eof && !atomic_load(&input_failed)) {
+    while (used < BLOCK_SIZE) {
+      ssize_t n = read(fd, &buf[used], BLOCK_SIZE - used);
+      if (n == -1) {
+        perror("read error");
+        atomic_store(&input_failed, 1);
+        break;
+      }
+      if (n == 0) {
+        eof = 1;
+        break;
+      }
+      used += (size_t)n;
+    }
+
+    // tolerate a missing newline at the very end of the input
+    // (there is always room for it in the padding)
+    if (eof && used > 0 && buf[used - 1] != '\n') {
+      buf[used++] = '\n';
+    }
+
+    // rewind to the last newline
+    // and move whatever comes after it to the start of the next block
+    size_t len = used;
+    while (len > 0 && buf[len - 1] != '\n') {
+      len--;
+    }
+    if (len == 0 && used > 0) {
+      fprintf(stderr, "line longer than %d bytes\n", BLOCK_SIZE);
+      atomic_store(&input_failed, 1);
+    }
+    if (atomic_load(&input_failed)) {
+      queue_push(&free_blocks, (struct Block){.buf = buf});
+      break;
+    }
+
+    char *next = eof ? NULL : next_free_block();
+    if (next) {
+      memcpy(next, &buf[len], used - len);
+    }
+
+    if (len > 0) {
+      push_block(&filled_blocks, &blocks_filled,
+                 (struct Block){.buf = buf, .data = buf, .len = len});
+    } else {
+      queue_push(&free_blocks, (struct Block){.buf = buf});
+    }
+
+    buf = next;
+    used -= len;
+  }
+
+  finish_reading();
+}
+
+#ifdef HAVE_IO_URING
+// A minimal io_uring, set up with raw system calls (no liburing needed)
+struct Uring {
+  int fd;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+// returns 0 if io_uring is not available
+static int uring_init(struct Uring *ring, unsigned int entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    return 0;
+  }
+
+  // map submission and completion rings (a single mapping on newer kernels)
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  }
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  char *cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    close(ring->fd);
+    return 0;
+  }
+
+  ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+// queues (but doesn't submit) a read of len bytes at offset into buf
+static void uring_read(struct Uring *ring, int fd, char *buf, size_t len,
+                       size_t offset, uint64_t user_data) {
+  unsigned int tail = *ring->sq_tail;
+  unsigned int i = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  ring->sq_array[i] = i;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// trims the data read for the block starting at offset to whole lines,
+// using the same rule as process_chunk: skip the partial line at the start
+// and finish the line running into the next block (from the overlap)
+// a line too long for the overlap leaves the block empty and sets input_failed
+static struct Block trim_block(char *buf, size_t offset, size_t n,
+                               size_t sz) {
+  // tolerate a missing newline at the very end of the file
+  // (there is always room for it in the padding)
+  if (n > 0 && offset + n == sz && buf[n - 1] != '\n') {
+    buf[n++] = '\n';
+  }
+
+  char *s = buf;
+  char *end = buf + n;
+
+  if (offset > 0) {
+    s = memchr(buf, '\n', n);
+    s = s ? s + 1 : end;
+  }
+  if (offset + BLOCK_SIZE < sz) {
+    end = n > BLOCK_SIZE ? memchr(&buf[BLOCK_SIZE], '\n', n - BLOCK_SIZE) : NULL;
+    if (!end) {
+      fprintf(stderr, "line longer than %d bytes\n", READ_OVERLAP);
+      atomic_store(&input_failed, 1);
+      return (struct Block){.buf = buf, .data = buf, .len = 0};
+    }
+    end++;
+  }
+
+  return (struct Block){
+      .buf = buf, .data = s, .len = s < end ? (size_t)(end - s) : 0};
+}
+
+// reads a regular file of sz bytes with a deep queue of large reads
+// (one per free buffer) and hands every completed block to the workers
+// the reads are independent of each other, so they may complete in any order
+// after a read error (or an overlong line), only those in flight are finished
+static void read_blocks_uring(struct Uring *ring, int fd, size_t sz,
+                              size_t depth) {
+  const size_t nblocks = (sz + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  struct Pending {
+    char *buf;
+    size_t offset;
+    size_t done;
+  } *pending = calloc(depth, sizeof(*pending));
+  if (!pending) {
+    perror("malloc error");
+    atomic_store(&input_failed, 1);
+    finish_reading();
+    return;
+  }
+
+  size_t next = 0;
+  size_t inflight = 0;
+  unsigned int to_submit = 0;
+  struct Block block;
+
+  while (next < nblocks || inflight > 0) {
+    // start reading the next blocks into any buffers the workers gave back
+    // if every buffer is being processed, wait for them to give one back
+    while (next < nblocks && inflight < depth) {
+      if (inflight == 0) {
+        block.buf = next_free_block();
+      } else if (!queue_pop(&free_blocks, &block)) {
+        break;
+      }
+      size_t slot = 0;
+      while (pending[slot].buf) {
+        slot++;
+      }
+      pending[slot] = (struct Pending){block.buf, next * BLOCK_SIZE, 0};
+      uring_read(ring, fd, block.buf, BLOCK_SIZE + READ_OVERLAP,
+                 pending[slot].offset, slot);
+      next++;
+      inflight++;
+      to_submit++;
+    }
+
+    // submit new reads and wait for at least one of them to complete
+    if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // the buffers of the reads in flight are left to the kernel
+      perror("io_uring_enter error");
+      atomic_store(&input_failed, 1);
+      break;
+    }
+    to_submit = 0;
+
+    unsigned int head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      struct Pending *p = &pending[cqe->user_data];
+      head++;
+
+      if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("read error");
+        atomic_store(&input_failed, 1);
+        queue_push(&free_blocks, (struct Block){.buf = p->buf});
+        p->buf = NULL;
+        inflight--;
+        continue;
+      }
+
+      // ask for the rest after a short read, unless we hit EOF
+      size_t want = BLOCK_SIZE + READ_OVERLAP;
+      if (want > sz - p->offset) {
+        want = sz - p->offset;
+      }
+      p->done += (size_t)cqe->res;
+      if (cqe->res > 0 && p->done < want) {
+        uring_read(ring, fd, &p->buf[p->done], want - p->done,
+                   p->offset + p->done, cqe->user_data);
+        to_submit++;
+        continue;
+      }
+
+      push_block(&filled_blocks, &blocks_filled,
+                 trim_block(p->buf, p->offset, p->done, sz));
+      p->buf = NULL;
+      inflight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // after bad input, only wait for the reads still in flight
+    if (atomic_load(&input_failed)) {
+      next = nblocks;
+    }
+  }
+
+  free(pending);
+  finish_reading();
+}
+#endif
+
+// reads a list of CPUs like "0-3,8-11" from a sysfs file
+// returns 0 if the file doesn't exist
+static int read_cpulist(const char *path, cpu_set_t *set) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+
+  CPU_ZERO(set);
+  unsigned int lo, hi;
+  while (fscanf(f, "%u", &lo) == 1) {
+    hi = lo;
+    int c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%u", &hi) != 1) {
+        break;
+      }
+      c = fgetc(f);
+    }
+    for (unsigned int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    if (c != ',') {
+      break;
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+static void numa_init(void) {
+  char path[64];
+  cpu_set_t cpus;
+  for (unsigned int node = 0; node < MAX_NODES; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+             node);
+    if (!read_cpulist(path, &cpus)) {
+      continue;
+    }
+    nnodes = node + 1;
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpus)) {
+        cpu_nodes[cpu] = (unsigned char)node;
+      }
+    }
+  }
+}
+
+// lists the CPUs we may run on to pin workers to,
+// taking turns between NUMA nodes so that every node gets its share
+// with no_smt, only the first hardware thread of every core is used
+// if we can't tell which CPUs we may run on, nothing is pinned
+static void pin_init(int no_smt) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    perror("sched_getaffinity error");
+    return;
+  }
+
+  if (no_smt) {
+    char path[96];
+    cpu_set_t siblings;
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      snprintf(path, sizeof(path),
+               "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list",
+               cpu);
+      if (!CPU_ISSET(cpu, &allowed) || !read_cpulist(path, &siblings)) {
+        continue;
+      }
+      for (unsigned int sibling = cpu + 1; sibling < CPU_SETSIZE; sibling++) {
+        if (CPU_ISSET(sibling, &siblings)) {
+          CPU_CLR(sibling, &allowed);
+        }
+      }
+    }
+  }
+
+  unsigned int next[MAX_NODES] = {0};
+  int found = 1;
+  while (found) {
+    found = 0;
+    for (unsigned int node = 0; node < nnodes; node++) {
+      unsigned int cpu = next[node];
+      while (cpu < CPU_SETSIZE &&
+             (!CPU_ISSET(cpu, &allowed) || cpu_nodes[cpu] != node)) {
+        cpu++;
+      }
+      if (cpu < CPU_SETSIZE) {
+        pin_cpus[npins++] = cpu;
+        found = 1;
+      }
+      next[node] = cpu + 1;
+    }
+  }
+}
+
+// Worker threads are started on first use, then park between runs
+// so that aggregating files again doesn't pay for creating them
+struct Pool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  void *(*job)(void *);
+  void **results;
+  // bumped for every run, threads wait for it to change
+  unsigned long run;
+  // threads started, taking part in this run, and still working on it
+  unsigned int size;
+  unsigned int active;
+  unsigned int busy;
+};
+static struct Pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static void *pool_thread(void *arg) {
+  const unsigned int i = (unsigned int)(uintptr_t)arg;
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  int pinned = -1;
+
+  // a thread that was just started joins the first run it's part of
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool.lock);
+  while (1) {
+    while (pool.run == seen) {
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    seen = pool.run;
+    if (i >= pool.active) {
+      continue;
+    }
+    void *(*job)(void *) = pool.job;
+    pthread_mutex_unlock(&pool.lock);
+
+    // pin to this run's CPU, or undo an earlier run's pinning
+    const int cpu = npins > 0 ? (int)pin_cpus[i % npins] : -1;
+    if (cpu != pinned) {
+      cpu_set_t cpus = allowed;
+      if (cpu != -1) {
+        CPU_ZERO(&cpus);
+        CPU_SET((unsigned int)cpu, &cpus);
+      }
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+      pinned = cpu;
+    }
+    void *result = job((void *)(uintptr_t)i);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.results[i] = result;
+    if (--pool.busy == 0) {
+      pthread_cond_signal(&pool.idle);
+    }
+  }
+  return NULL;
+}
+
+// starts workers until there are nthreads of them
+// returns -1 if there can't be that many
+static int grow_pool(void) {
+  int ret = 0;
+  pthread_mutex_lock(&pool.lock);
+  if (nthreads > pool.size) {
+    void **results = realloc(pool.results, nthreads * sizeof(*results));
+    if (results) {
+      pool.results = results;
+    } else {
+      perror("realloc error");
+      ret = -1;
+    }
+  }
+  for (; ret == 0 && pool.size < nthreads; pool.size++) {
+    pthread_t thread;
+    const int err = pthread_create(&thread, NULL, pool_thread,
+                                   (void *)(uintptr_t)pool.size);
+    if (err != 0) {
+      errno = err;
+      perror("pthread_create error");
+      ret = -1;
+      break;
+    }
+    pthread_detach(thread);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return ret;
+}
+
+// runs job(i) on worker i for every one of the nthreads workers
+// (which grow_pool has started)
+static void start_workers(void *(*job)(void *)) {
+  pthread_mutex_lock(&pool.lock);
+  pool.job = job;
+  pool.active = pool.busy = nthreads;
+  pool.run++;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// waits for the workers to finish their job, and collects what they returned
+static void wait_workers(struct Result **results) {
+  pthread_mutex_lock(&pool.lock);
+  while (pool.busy > 0) {
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  }
+  for (unsigned int i = 0; i < nthreads; i++) {
+    results[i] = pool.results[i];
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// puts every chunk in the queue of the NUMA node its pages live on
+// (according to move_pages), chunks on unknown nodes are spread evenly
+// returns -1 if there's no memory for the queues
+static int distribute_chunks(void) {
+  chunk_order = malloc((chunk_count + 1) * sizeof(*chunk_order));
+  int *nodes = malloc((chunk_count + 1) * sizeof(*nodes));
+  if (!chunk_order || !nodes) {
+    perror("malloc error");
+    free(chunk_order);
+    free(nodes);
+    chunk_order = NULL;
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < chunk_count; i++) {
+    nodes[i] = 0;
+  }
+#ifdef SYS_move_pages
+  if (nnodes > 1) {
+    // look at the page in the middle of every chunk, without faulting it
+    // in: a page that isn't mapped yet (-ENOENT) is on an unknown node,
+    // and so is every chunk without memory to ask
+    void **pages = malloc((chunk_count + 1) * sizeof(*pages));
+    for (unsigned int i = 0; pages && i < chunk_count; i++) {
+      const struct Input *in = &inputs[chunk_input(i)];
+      size_t start = chunk_offset(in, i);
+      size_t offset = start + CHUNK_SIZE / 2;
+      pages[i] = (void *)&in->data[offset < in->size ? offset : start];
+    }
+    if (!pages ||
+        syscall(SYS_move_pages, 0, chunk_count, pages, NULL, nodes, 0) != 0) {
+      for (unsigned int i = 0; i < chunk_count; i++) {
+        nodes[i] = -1;
+      }
+    }
+    for (unsigned int i = 0; i < chunk_count; i++) {
+      if (nodes[i] < 0 || (unsigned int)nodes[i] >= nnodes) {
+        nodes[i] = (int)(i % nnodes);
+      }
+    }
+    free(pages);
+  }
+#endif
+
+  // counting sort by node, keeping file order within every node
+  unsigned int n = 0;
+  for (unsigned int node = 0; node < nnodes; node++) {
+    struct ChunkQueue *queue = &chunk_queues[node];
+    atomic_init(&queue->next, n);
+    for (unsigned int i = 0; i < chunk_count; i++) {
+      if ((unsigned int)nodes[i] == node) {
+        chunk_order[n++] = i;
+      }
+    }
+    queue->end = n;
+  }
+  free(nodes);
+  return 0;
+}
+
+// A checkpoint: everything up to offset in the file identified by
+// dev, ino and the checksum of the last block before offset
+#define CHECKPOINT_MAGIC "1brcckp1"
+#define CHECKPOINT_BLOCK 4096
+struct Checkpoint {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t offset;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t checksum;
+  uint64_t n;
+};
+
+// FNV-1a of the block of the file that ends at offset
+static uint64_t checkpoint_checksum(const char *data, size_t offset) {
+  size_t start = offset > CHECKPOINT_BLOCK ? offset - CHECKPOINT_BLOCK : 0;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = start; i < offset; i++) {
+    h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// loads the checkpoint at path if it still matches the file, which has to
+// be the same inode and unchanged up to the checkpoint's offset
+// returns NULL if there's no (usable) checkpoint, or no memory to load it
+// (which out_of_memory tells apart)
+static struct Result *load_checkpoint(const char *path, const struct stat *sb,
+                                      const char *data, size_t end,
+                                      size_t *offset) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+
+  char magic[sizeof(CHECKPOINT_MAGIC) - 1];
+  struct Checkpoint cp;
+  if (fread(magic, sizeof(magic), 1, f) != 1 ||
+      memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+      fread(&cp, sizeof(cp), 1, f) != 1) {
+    fprintf(stderr, "%s is not a checkpoint, starting over\n", path);
+    fclose(f);
+    return NULL;
+  }
+  if (cp.dev != (uint64_t)sb->st_dev || cp.ino != (uint64_t)sb->st_ino ||
+      cp.offset > end || cp.mtime_sec > (int64_t)sb->st_mtim.tv_sec ||
+      cp.checksum != checkpoint_checksum(data, cp.offset)) {
+    fprintf(stderr, "checkpoint %s is out of date, starting over\n", path);
+    fclose(f);
+    return NULL;
+  }
+
+  struct Result *result = result_new();
+  if (!result || !read_groups(f, result, cp.n)) {
+    if (!out_of_memory) {
+      fprintf(stderr, "checkpoint %s is corrupt, starting over\n", path);
+    }
+    if (result) {
+      result_free(result);
+    }
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *offset = cp.offset;
+  return result;
+}
+
+// stores result as the aggregates of the file up to offset
+// written to a temporary file first, so a checkpoint is never half-written
+// returns -1 if it can't be written
+static int save_checkpoint(const char *path, const struct stat *sb,
+                           const char *data, size_t offset,
+                           const struct Result *result) {
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    fprintf(stderr, "checkpoint path too long\n");
+    return -1;
+  }
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    perror("error writing checkpoint");
+    return -1;
+  }
+
+  struct Checkpoint cp = {
+      .dev = (uint64_t)sb->st_dev,
+      .ino = (uint64_t)sb->st_ino,
+      .offset = offset,
+      .mtime_sec = (int64_t)sb->st_mtim.tv_sec,
+      .mtime_nsec = (int64_t)sb->st_mtim.tv_nsec,
+      .checksum = checkpoint_checksum(data, offset),
+      .n = result->n,
+  };
+  fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) - 1, 1, f);
+  fwrite(&cp, sizeof(cp), 1, f);
+  write_groups(f, result);
+  int failed = ferror(f);
+  failed |= fclose(f) != 0;
+  if (failed || rename(tmp, path) != 0) {
+    perror("error writing checkpoint");
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// returns how many kB of the mappings inside [start, end) are backed by
+// huge pages according to /proc/self/smaps, or all mappings if start is NULL
+static size_t huge_kb(const void *start, const void *end) {
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if (!f) {
+    return 0;
+  }
+
+  char line[512];
+  size_t total = 0;
+  int inside = 0;
+  while (fgets(line, sizeof(line), f)) {
+    uintptr_t lo, hi;
+    size_t kb;
+    char field[64];
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+      inside = !start || (lo >= (uintptr_t)start && hi <= (uintptr_t)end);
+    } else if (inside && sscanf(line, "%63s %zu kB", field, &kb) == 2 &&
+               (strcmp(field, "AnonHugePages:") == 0 ||
+                strcmp(field, "ShmemPmdMapped:") == 0 ||
+                strcmp(field, "FilePmdMapped:") == 0 ||
+                strcmp(field, "Shared_Hugetlb:") == 0 ||
+                strcmp(field, "Private_Hugetlb:") == 0)) {
+      total += kb;
+    }
+  }
+  fclose(f);
+  return total;
+}
+
+struct brc {
+  struct brc_options options;
+  struct Result *result;
+  struct StationSet *stations;
+  double *percentiles;
+
+  // results of every file on their own (with per_file)
+  struct brc **files;
+  size_t nfiles;
+  const char *path;
+
+  // all files aggregated so far, which stay mapped until brc_free
+  // and the paths they were found through
+  struct Input *inputs;
+  unsigned int ninputs;
+  unsigned int inputs_capacity;
+  char **sources;
+  size_t nsources;
+
+  // lines near the end of a pushed buffer are parsed from this padded copy
+  char *tail;
+  size_t tail_capacity;
+  // and all of them into this result first, then merged in as a whole
+  struct Result *scratch;
+};
+
+// Only one call aggregates files at a time, as the workers share the globals
+static pthread_mutex_t aggregate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+// returns -1 if there's no memory for another file
+static int add_input(struct brc *b, const char *path) {
+  if (b->ninputs == b->inputs_capacity) {
+    const unsigned int capacity =
+        b->inputs_capacity ? b->inputs_capacity * 2 : 16;
+    struct Input *inputs = realloc(b->inputs, capacity * sizeof(*inputs));
+    if (!inputs) {
+      perror("realloc error");
+      return -1;
+    }
+    b->inputs = inputs;
+    b->inputs_capacity = capacity;
+  }
+  char *copy = strdup(path);
+  if (!copy) {
+    perror("malloc error");
+    return -1;
+  }
+  b->inputs[b->ninputs++] = (struct Input){.path = copy};
+  return 0;
+}
+
+// unmaps the files of b from the start-th on and forgets about them
+static void close_inputs(struct brc *b, unsigned int start) {
+  for (unsigned int i = start; i < b->ninputs; i++) {
+    struct Input *in = &b->inputs[i];
+    if (in->data) {
+      munmap(in->data, in->mapped + MMAP_PADDING);
+    }
+    free(in->stations);
+    free((char *)in->path);
+  }
+  b->ninputs = start;
+}
+
+// adds path to the files to process, or all regular files in it if it's a
+// directory (in alphabetical order, skipping hidden files)
+// paths that don't exist are tried as a pattern, like "data/*.txt"
+// returns -1 if there's nothing to process (or no memory to list it)
+static int add_inputs(struct brc *b, const char *path) {
+  struct stat st;
+  const int exists = stat(path, &st) == 0;
+  if (strcmp(path, "-") == 0 || (exists && !S_ISDIR(st.st_mode))) {
+    return add_input(b, path);
+  }
+
+  char pattern[4096];
+  if (!exists) {
+    snprintf(pattern, sizeof(pattern), "%s", path);
+  } else if (snprintf(pattern, sizeof(pattern), "%s%s*", path,
+                      path[strlen(path) - 1] == '/' ? "" : "/") >=
+             (int)sizeof(pattern)) {
+    fprintf(stderr, "%s: path too long\n", path);
+    return -1;
+  }
+  glob_t g;
+  if (glob(pattern, 0, NULL, &g) != 0) {
+    // let opening it report what's wrong
+    if (!exists) {
+      return add_input(b, path);
+    }
+  }
+  const unsigned int before = b->ninputs;
+  for (size_t i = 0; i < g.gl_pathc; i++) {
+    if (stat(g.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode) &&
+        add_input(b, g.gl_pathv[i]) != 0) {
+      globfree(&g);
+      return -1;
+    }
+  }
+  globfree(&g);
+  if (b->ninputs == before) {
+    fprintf(stderr, "%s: no files to process\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// maps sz bytes of fd into memory
+// on top of a slightly larger anonymous mapping,
+// so that reading a few bytes past the last line is always safe
+// with huge pages, the file starts at a huge page boundary
+// returns NULL if the file can't be mapped
+static char *map_file(int fd, size_t sz) {
+  const size_t align = huge_pages ? HUGE_PAGE_SIZE : 0;
+  const size_t reserved_size = sz + MMAP_PADDING + align;
+  char *reserved = mmap(NULL, reserved_size, PROT_READ,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    perror("error mmapping file");
+    return NULL;
+  }
+  char *data = reserved;
+  if (align) {
+    // give back whatever lies outside of the aligned range,
+    // in whole pages as munmap wants them
+    const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    data = (char *)(((uintptr_t)reserved + align - 1) & ~(align - 1));
+    char *end = (char *)(((uintptr_t)data + sz + MMAP_PADDING + page - 1) &
+                         ~(page - 1));
+    if ((data > reserved &&
+         munmap(reserved, (size_t)(data - reserved)) != 0) ||
+        (reserved + reserved_size > end &&
+         munmap(end, (size_t)(reserved + reserved_size - end)) != 0)) {
+      perror("error unmapping padding");
+      munmap(reserved, reserved_size);
+      return NULL;
+    }
+  }
+  if (sz > 0 &&
+      mmap(data, sz, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    perror("error mmapping file");
+    munmap(data, sz + MMAP_PADDING);
+    return NULL;
+  }
+  return data;
+}
+
+// returns whether the file fd starts like a columnar file
+static int is_columnar(int fd) {
+  char magic[sizeof(COLUMNAR_MAGIC) - 1];
+  return pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+         memcmp(magic, COLUMNAR_MAGIC, sizeof(magic)) == 0;
+}
+
+// checks whether the mapped file is a columnar file
+// and if so, reads its header and dictionary
+// returns -1 if it's a columnar file that doesn't add up
+// (or there's no memory for its dictionary)
+static int open_columnar(struct Input *in) {
+  const struct ColumnarHeader *h = (const struct ColumnarHeader *)in->data;
+  if (in->size < sizeof(h->magic) ||
+      memcmp(h->magic, COLUMNAR_MAGIC, sizeof(h->magic)) != 0) {
+    return 0;
+  }
+  if (in->size < COLUMNAR_DATA_OFFSET || h->block_rows == 0 ||
+      h->stations > COLUMNAR_MAX_STATIONS ||
+      h->rows > (in->size - COLUMNAR_DATA_OFFSET) / 4 ||
+      h->dictionary != COLUMNAR_DATA_OFFSET + h->rows * 4 ||
+      (h->rows + h->block_rows - 1) / h->block_rows > UINT32_MAX) {
+    fprintf(stderr, "%s: malformed columnar file\n", in->path);
+    return -1;
+  }
+
+  in->stations = malloc((h->stations + 1) * sizeof(*in->stations));
+  if (!in->stations) {
+    perror("malloc error");
+    return -1;
+  }
+  size_t offset = h->dictionary;
+  for (unsigned int id = 0; id < h->stations; id++) {
+    uint32_t len;
+    if (in->size - offset < sizeof(len)) {
+      fprintf(stderr, "%s: malformed columnar file\n", in->path);
+      return -1;
+    }
+    memcpy(&len, &in->data[offset], sizeof(len));
+    offset += sizeof(len);
+    if (in->size - offset < len) {
+      fprintf(stderr, "%s: malformed columnar file\n", in->path);
+      return -1;
+    }
+    struct Station *st = &in->stations[id];
+    st->key = &in->data[offset];
+    st->len = len;
+    st->hash = hash_key(st->key, len);
+    offset += len;
+  }
+  in->columnar = h;
+  return 0;
+}
+
+// An index of a text file, mapped along with the stations of its dictionary
+struct Index {
+  char *data;
+  size_t size;
+  const struct IndexHeader *header;
+  const struct IndexBlock *blocks;
+  const uint64_t *bitmaps;
+  const struct IndexGroup *groups;
+  uint64_t words;
+  struct Station *stations;
+};
+
+// maps the index at path and checks that it's an index of in as it is now
+// returns -1 if it isn't, or doesn't add up
+static int open_index(struct Index *ix, const char *path,
+                      const struct Input *in) {
+  *ix = (struct Index){0};
+  int fd = open(path, O_RDONLY);
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    perror(path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  ix->size = (size_t)sb.st_size;
+  if (ix->size < sizeof(*ix->header)) {
+    fprintf(stderr, "%s is not an index\n", path);
+    close(fd);
+    return -1;
+  }
+  ix->data = mmap(NULL, ix->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ix->data == MAP_FAILED) {
+    perror("error mmapping index");
+    ix->data = NULL;
+    return -1;
+  }
+
+  const struct IndexHeader *h = (const struct IndexHeader *)ix->data;
+  ix->header = h;
+  if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0) {
+    fprintf(stderr, "%s is not an index\n", path);
+    return -1;
+  }
+  if (h->dev != (uint64_t)in->st.st_dev ||
+      h->ino != (uint64_t)in->st.st_ino ||
+      h->size != in->size + in->tail ||
+      h->mtime_sec != (int64_t)in->st.st_mtim.tv_sec ||
+      h->mtime_nsec != (int64_t)in->st.st_mtim.tv_nsec) {
+    fprintf(stderr, "index %s is out of date, run brc-index again\n", path);
+    return -1;
+  }
+
+  // sizes are checked one section at a time, so that none overflow
+  const uint64_t max_blocks = ix->size / sizeof(struct IndexBlock);
+  if (h->block_size == 0 ||
+      h->blocks != (h->size + h->block_size - 1) / h->block_size ||
+      h->blocks > max_blocks || h->stations > UINT32_MAX ||
+      (h->blocks > 0 && index_words(h) > ix->size / 8 / h->blocks) ||
+      index_groups(h) > ix->size ||
+      h->groups > (ix->size - index_groups(h)) / sizeof(struct IndexGroup) ||
+      h->dictionary != index_groups(h) + h->groups * sizeof(struct IndexGroup)) {
+    fprintf(stderr, "%s: malformed index\n", path);
+    return -1;
+  }
+  ix->blocks = (const struct IndexBlock *)&ix->data[sizeof(*h)];
+  ix->bitmaps = (const uint64_t *)&ix->data[index_bitmaps(h)];
+  ix->groups = (const struct IndexGroup *)&ix->data[index_groups(h)];
+  ix->words = index_words(h);
+
+  // every block's rows and groups have to lie within those of the file
+  for (uint64_t k = 0; k < h->blocks; k++) {
+    const struct IndexBlock *block = &ix->blocks[k];
+    uint64_t groups = 0;
+    for (uint64_t w = 0; w < ix->words; w++) {
+      groups += (uint64_t)__builtin_popcountll(ix->bitmaps[k * ix->words + w]);
+    }
+    if (block->offset > h->size || block->first_row > h->rows ||
+        block->rows > h->rows - block->first_row ||
+        block->groups > h->groups || groups > h->groups - block->groups ||
+        (h->stations % 64 &&
+         ix->bitmaps[(k + 1) * ix->words - 1] >> (h->stations % 64))) {
+      fprintf(stderr, "%s: malformed index\n", path);
+      return -1;
+    }
+  }
+
+  ix->stations = malloc((h->stations + 1) * sizeof(*ix->stations));
+  if (!ix->stations) {
+    perror("malloc error");
+    return -1;
+  }
+  size_t offset = h->dictionary;
+  for (uint64_t id = 0; id < h->stations; id++) {
+    uint32_t len;
+    if (ix->size - offset < sizeof(len)) {
+      fprintf(stderr, "%s: malformed index\n", path);
+      return -1;
+    }
+    memcpy(&len, &ix->data[offset], sizeof(len));
+    offset += sizeof(len);
+    if (ix->size - offset < len) {
+      fprintf(stderr, "%s: malformed index\n", path);
+      return -1;
+    }
+    struct Station *st = &ix->stations[id];
+    st->key = &ix->data[offset];
+    st->len = len;
+    st->hash = hash_key(st->key, len);
+    offset += len;
+  }
+  return 0;
+}
+
+static void close_index(struct Index *ix) {
+  if (ix->data) {
+    munmap(ix->data, ix->size);
+  }
+  free(ix->stations);
+}
+
+// returns whether two bitmaps of n words have a bit in common
+static int bitmaps_overlap(const uint64_t *a, const uint64_t *b, uint64_t n) {
+  for (uint64_t w = 0; w < n; w++) {
+    if (a[w] & b[w]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// aggregates rows [first_row, last_row) of in, of the stations in station_set
+// (if any), with the help of its index: blocks that lie within the range
+// add their aggregates, only those at its edges are parsed, and blocks
+// without any of the stations are skipped
+// returns NULL if a station gets too many rows, or there's no memory left
+static struct Result *query_index(const struct Index *ix,
+                                  const struct Input *in, uint64_t first_row,
+                                  uint64_t last_row) {
+  const struct IndexHeader *h = ix->header;
+  if (last_row == 0 || last_row > h->rows) {
+    last_row = h->rows;
+  }
+
+  // the ids of the stations in the set, as a bitmap like those of the blocks
+  uint64_t *wanted = NULL;
+  if (station_set) {
+    wanted = calloc(ix->words + 1, sizeof(*wanted));
+    if (!wanted) {
+      perror("malloc error");
+      return NULL;
+    }
+    for (uint64_t id = 0; id < h->stations; id++) {
+      const struct Station *st = &ix->stations[id];
+      if (station_set_contains(station_set, st->key, st->len, st->hash)) {
+        wanted[id / 64] |= (uint64_t)1 << (id % 64);
+      }
+    }
+  }
+
+  struct Result *result = result_new();
+  for (uint64_t k = 0; result && k < h->blocks; k++) {
+    const struct IndexBlock *block = &ix->blocks[k];
+    const uint64_t *bitmap = &ix->bitmaps[k * ix->words];
+    const uint64_t end_row = block->first_row + block->rows;
+    if (block->rows == 0 || end_row <= first_row ||
+        block->first_row >= last_row ||
+        (wanted && !bitmaps_overlap(bitmap, wanted, ix->words))) {
+      continue;
+    }
+
+    if (block->first_row >= first_row && end_row <= last_row) {
+      const struct IndexGroup *g = &ix->groups[block->groups];
+      for (uint64_t w = 0; w < ix->words; w++) {
+        for (uint64_t bits = bitmap[w]; bits; bits &= bits - 1, g++) {
+          const uint64_t id = w * 64 + (uint64_t)__builtin_ctzll(bits);
+          if (wanted && !(wanted[w] & (bits & -bits))) {
+            continue;
+          }
+          const struct Station *st = &ix->stations[id];
+          unsigned int c = hashmap_entry(result, st->key, st->len, st->hash);
+          if (!group_merge(&result->groups[c], &(struct Group){
+                                                   .sum = g->sum,
+                                                   .count = g->count,
+                                                   .min = g->min,
+                                                   .max = g->max,
+                                               })) {
+            result_free(result);
+            free(wanted);
+            return NULL;
+          }
+        }
+      }
+      continue;
+    }
+
+    // an edge block: skip to the first row in range, parse up to the last
+    const char *s = &in->data[block->offset];
+    const char *end = &in->data[in->size];
+    for (uint64_t row = block->first_row; row < end_row && row < last_row;
+         row++) {
+      if (s == end) {
+        // the last line, without a newline
+        if (row >= first_row) {
+          process_tail(result, in);
+        }
+        break;
+      }
+      if (row < first_row) {
+        const char *newline = memchr(s, '\n', (size_t)(end - s));
+        s = newline ? newline + 1 : end;
+      } else {
+        s = process_line_with(result, s, station_set);
+      }
+    }
+  }
+  free(wanted);
+  if (result && out_of_memory) {
+    result_free(result);
+    return NULL;
+  }
+  return result;
+}
+
+// gives up on aggregating the files of b from the start-th on
+static int input_error(struct brc *b, unsigned int start, int fd) {
+  if (fd > STDIN_FILENO) {
+    close(fd);
+  }
+  close_inputs(b, start);
+  return -1;
+}
+
+static void station_set_free(struct StationSet *set) {
+  for (unsigned int i = 0; i <= set->mask; i++) {
+    free((char *)set->slots[i].key);
+  }
+  free(set->slots);
+  free(set);
+}
+
+// returns the set of the n stations in names, or NULL if there's no memory
+// for it
+static struct StationSet *station_set_new(const char *const *names,
+                                          size_t n) {
+  unsigned int capacity = 4;
+  while (capacity < 2 * n) {
+    capacity *= 2;
+  }
+  struct StationSet *set = malloc(sizeof(*set));
+  struct Station *slots = calloc(capacity, sizeof(*slots));
+  if (!set || !slots) {
+    perror("malloc error");
+    free(set);
+    free(slots);
+    return NULL;
+  }
+  *set = (struct StationSet){slots, capacity - 1};
+
+  for (size_t i = 0; i < n; i++) {
+    const unsigned int len = (unsigned int)strlen(names[i]);
+    const unsigned int h = hash_key(names[i], len);
+    if (station_set_contains(set, names[i], len, h)) {
+      continue;
+    }
+    unsigned int j = h & set->mask;
+    while (slots[j].key) {
+      j = (j + 1) & set->mask;
+    }
+    slots[j] = (struct Station){strdup(names[i]), len, h};
+    if (!slots[j].key) {
+      perror("malloc error");
+      station_set_free(set);
+      return NULL;
+    }
+  }
+  return set;
+}
+
+// returns NULL if there's no memory for it
+static struct brc *brc_alloc(void) {
+  struct brc *b = calloc(1, sizeof(*b));
+  if (!b) {
+    perror("malloc error");
+    return NULL;
+  }
+  b->result = result_new();
+  if (!b->result) {
+    free(b);
+    return NULL;
+  }
+  return b;
+}
+
+// adds the result of every file to the per-file results of b
+// returns -1 (leaving b as it is) if there's no memory for that
+static int add_file_results(struct brc *b, struct Result **results) {
+  struct brc **files =
+      realloc(b->files, (b->nfiles + ninputs) * sizeof(*b->files));
+  if (!files) {
+    perror("realloc error");
+    return -1;
+  }
+  b->files = files;
+  for (unsigned int i = 0; i < ninputs; i++) {
+    struct brc *file = calloc(1, sizeof(*file));
+    if (!file) {
+      perror("malloc error");
+      while (i > 0) {
+        free(b->files[b->nfiles + --i]);
+      }
+      return -1;
+    }
+    file->options = b->options;
+    file->result = results[i];
+    file->path = inputs[i].path;
+    b->files[b->nfiles + i] = file;
+  }
+  b->nfiles += ninputs;
+  return 0;
+}
+
+// takes back what add_file_results just added to b, other than the results
+static void drop_file_results(struct brc *b) {
+  for (unsigned int i = 0; i < ninputs; i++) {
+    free(b->files[--b->nfiles]);
+  }
+}
+
+// adds the result of a call to brc_aggregate_files to those before it
+// freeing it is left to brc_free, it may be big
+// returns -1 (leaving both as they are) if a station gets too many rows
+static int add_result(struct brc *b, struct Result *result) {
+  if (b->result->n == 0) {
+    result_free(b->result);
+    b->result = result;
+  } else if (result_merge(b->result, result)) {
+    struct Result *last = result;
+    while (last->merged) {
+      last = last->merged;
+    }
+    last->merged = b->result->merged;
+    b->result->merged = result;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// aggregates the files in paths into b, holding aggregate_lock
+static int aggregate_files(struct brc *b, const char *const *paths,
+                           size_t npaths) {
+  // files (or directories, or patterns) to process
+  const unsigned int start = b->ninputs;
+  for (size_t i = 0; i < npaths; i++) {
+    if (add_inputs(b, paths[i]) != 0) {
+      return input_error(b, start, -1);
+    }
+  }
+  if (b->ninputs == start) {
+    return 0;
+  }
+  inputs = &b->inputs[start];
+  ninputs = b->ninputs - start;
+  const char *file = inputs[0].path;
+
+  nthreads = b->options.threads ? b->options.threads : available_cpus();
+  ncursors = b->options.cursors ? b->options.cursors : 2;
+  enum brc_engine engine = b->options.engine;
+  const char *checkpoint = b->options.checkpoint;
+  station_set = b->stations;
+  keep_histograms = b->result->hist != NULL;
+  keep_squares = b->result->squares != NULL;
+  if (checkpoint && (keep_histograms || keep_squares)) {
+    fprintf(stderr, "checkpoints don't keep histograms or sums of squares\n");
+    return input_error(b, start, -1);
+  }
+  // a checkpoint holds every station, as later runs may not filter the same
+  if (checkpoint && station_set) {
+    fprintf(stderr, "checkpoints can't be combined with a station filter\n");
+    return input_error(b, start, -1);
+  }
+  const char *index = b->options.index;
+  if (index && (keep_histograms || keep_squares)) {
+    fprintf(stderr, "indexes don't keep histograms or sums of squares\n");
+    return input_error(b, start, -1);
+  }
+  if (index && (ninputs > 1 || checkpoint)) {
+    fprintf(stderr, "an index covers a single file, without a checkpoint\n");
+    return input_error(b, start, -1);
+  }
+  npins = 0;
+  if (b->options.pin) {
+    pin_init(b->options.pin == 2);
+  }
+
+  // an index is queried on this thread alone
+  if (!index && grow_pool() != 0) {
+    return input_error(b, start, -1);
+  }
+
+  int fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY);
+  if (fd == -1) {
+    perror("error opening file");
+    return input_error(b, start, fd);
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    perror("error getting file size");
+    return input_error(b, start, fd);
+  }
+  inputs[0].st = sb;
+
+  // pipes and the like can only be streamed
+  // regular files are streamed as well when using io_uring
+  const int streaming = !S_ISREG(sb.st_mode);
+  if (!streaming && engine == BRC_ENGINE_URING && is_columnar(fd)) {
+    // columnar files have a scan engine of their own
+    engine = BRC_ENGINE_MMAP;
+  }
+  if (ninputs > 1) {
+    // several files are mapped and scheduled as one
+    if (streaming) {
+      fprintf(stderr, "%s: not a regular file\n", file);
+      return input_error(b, start, fd);
+    }
+    if (checkpoint) {
+      fprintf(stderr, "checkpoints need a single file\n");
+      return input_error(b, start, fd);
+    }
+    if (engine == BRC_ENGINE_URING) {
+      fprintf(stderr, "io_uring reads a single file, falling back to mmap\n");
+      engine = BRC_ENGINE_MMAP;
+    }
+  }
+  // a single file's results are the combined results
+  per_file = b->options.per_file && ninputs > 1;
+  if (checkpoint) {
+    // checkpoints need to pick up where they left off, which takes mmap
+    if (streaming) {
+      fprintf(stderr, "checkpoints need a regular file\n");
+      return input_error(b, start, fd);
+    }
+    engine = BRC_ENGINE_MMAP;
+  }
+  if (index) {
+    // so do indexes, to parse the blocks at the edges of the range
+    if (streaming) {
+      fprintf(stderr, "indexes need a regular file\n");
+      return input_error(b, start, fd);
+    }
+    engine = BRC_ENGINE_MMAP;
+  }
+
+  const size_t nblocks = 2 * (size_t)nthreads + 2 < MAX_BLOCKS
+                             ? 2 * (size_t)nthreads + 2
+                             : MAX_BLOCKS;
+#ifdef HAVE_IO_URING
+  struct Uring ring;
+  int direct_fd = -1;
+  if (!streaming && engine == BRC_ENGINE_URING) {
+    if (!uring_init(&ring, (unsigned int)nblocks)) {
+      fprintf(stderr, "io_uring not available, falling back to mmap\n");
+      engine = BRC_ENGINE_MMAP;
+    } else {
+      // bypass the page cache if the filesystem lets us
+      direct_fd = open(file, O_RDONLY | O_DIRECT);
+      if (direct_fd == -1) {
+        fprintf(stderr, "O_DIRECT not supported, using buffered reads\n");
+      }
+    }
+  }
+#endif
+  const int mapped = !streaming && engine == BRC_ENGINE_MMAP;
+
+  // map every file into memory
+  // and number their chunks one after the other
+  struct Result *previous = NULL;
+  struct statfs fs;
+  int advised = 1;
+  chunk_count = 0;
+  if (huge_pages && fstatfs(fd, &fs) != 0) {
+    fs.f_type = 0;
+  }
+  for (unsigned int i = 0; mapped && i < ninputs; i++) {
+    struct Input *in = &inputs[i];
+    int in_fd = fd;
+    struct stat in_sb = sb;
+    if (i > 0) {
+      in_fd = open(in->path, O_RDONLY);
+      if (in_fd == -1 || fstat(in_fd, &in_sb) == -1) {
+        perror(in->path);
+        if (in_fd != -1) {
+          close(in_fd);
+        }
+        return input_error(b, start, fd);
+      }
+      if (!S_ISREG(in_sb.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", in->path);
+        close(in_fd);
+        return input_error(b, start, fd);
+      }
+    }
+    in->st = in_sb;
+    in->size = (size_t)in_sb.st_size;
+    in->data = map_file(in_fd, in->size);
+    if (i > 0) {
+      close(in_fd);
+    }
+    if (!in->data) {
+      return input_error(b, start, fd);
+    }
+    in->mapped = in->size;
+
+    // hugetlbfs files are always mapped with huge pages
+    // tmpfs and the page cache of other filesystems need to be asked
+    if (huge_pages && fs.f_type != HUGETLBFS_MAGIC) {
+#ifdef MADV_HUGEPAGE
+      advised &= madvise(in->data, in->size, MADV_HUGEPAGE) == 0;
+#else
+      advised = 0;
+#endif
+    }
+
+    if (open_columnar(in) != 0) {
+      return input_error(b, start, fd);
+    }
+    if (checkpoint && in->columnar) {
+      fprintf(stderr, "checkpoints need a text file\n");
+      return input_error(b, start, fd);
+    }
+    if (index && in->columnar) {
+      fprintf(stderr, "indexes need a text file\n");
+      return input_error(b, start, fd);
+    }
+
+    // with a checkpoint, only what was appended since is parsed
+    // a partial line at the end is left for the next run
+    if (checkpoint) {
+      const char *last = memrchr(in->data, '\n', in->size);
+      in->size = last ? (size_t)(last - in->data) + 1 : 0;
+      previous =
+          load_checkpoint(checkpoint, &sb, in->data, in->size, &in->start);
+      if (out_of_memory) {
+        return input_error(b, start, fd);
+      }
+    }
+
+    // the workers would run past a last line without a newline
+    if (!in->columnar && !checkpoint && in->size > 0 &&
+        in->data[in->size - 1] != '\n') {
+      const char *last = memrchr(in->data, '\n', in->size);
+      const size_t size = last ? (size_t)(last - in->data) + 1 : 0;
+      in->tail = in->size - size;
+      in->size = size;
+    }
+
+    in->first_chunk = (unsigned int)chunk_count;
+    if (in->columnar) {
+      const struct ColumnarHeader *h = in->columnar;
+      chunk_count += (h->rows + h->block_rows - 1) / h->block_rows;
+    } else {
+      chunk_count += (in->size - in->start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+  }
+  if (huge_pages && mapped) {
+    const char *type = fs.f_type == HUGETLBFS_MAGIC ? "hugetlbfs"
+                       : fs.f_type == TMPFS_MAGIC   ? "tmpfs"
+                                                    : "page cache";
+    fprintf(stderr, "huge pages: input on %s, MADV_HUGEPAGE %s\n", type,
+            advised ? "accepted" : "refused");
+  }
+
+  // with an index, there's at most two blocks to parse,
+  // which isn't worth handing out to the workers
+  if (index) {
+    struct Index ix;
+    if (open_index(&ix, index, &inputs[0]) != 0) {
+      close_index(&ix);
+      return input_error(b, start, fd);
+    }
+    struct Result *result = query_index(&ix, &inputs[0], b->options.first_row,
+                                        b->options.last_row);
+    close_index(&ix);
+    if (!result) {
+      return input_error(b, start, fd);
+    }
+    close(fd);
+    struct Result *file_result = NULL;
+    int failed = 0;
+    if (b->options.per_file) {
+      file_result = new_result();
+      failed = !file_result || !result_merge(file_result, result) ||
+               add_file_results(b, &file_result) != 0;
+    }
+    if (!failed && add_result(b, result) != 0) {
+      if (file_result) {
+        drop_file_results(b);
+      }
+      failed = 1;
+    }
+    if (failed) {
+      if (file_result) {
+        result_free(file_result);
+      }
+      result_free(result);
+      return input_error(b, start, -1);
+    }
+    return 0;
+  }
+
+  struct Result **results = malloc(nthreads * sizeof(*results));
+  if (!results) {
+    perror("malloc error");
+  }
+  atomic_store(&pending_result, NULL);
+  atomic_store(&results_left, nthreads);
+  atomic_store(&merge_failed, 0);
+  atomic_store(&input_failed, 0);
+
+  if (!mapped) {
+    // every worker can hold on to two blocks while the reader fills the rest,
+    // up to MAX_BLOCKS in all
+    if (!results || blocks_init(nblocks) != 0) {
+      free(results);
+#ifdef HAVE_IO_URING
+      if (!streaming) {
+        close(ring.fd);
+        if (direct_fd != -1) {
+          close(direct_fd);
+        }
+      }
+#endif
+      return input_error(b, start, fd);
+    }
+
+    start_workers(process_blocks);
+#ifdef HAVE_IO_URING
+    if (!streaming) {
+      read_blocks_uring(&ring, direct_fd != -1 ? direct_fd : fd,
+                        (size_t)sb.st_size, nblocks);
+      close(ring.fd);
+      if (direct_fd != -1) {
+        close(direct_fd);
+      }
+    } else {
+      read_blocks(fd);
+    }
+#else
+    read_blocks(fd);
+#endif
+    wait_workers(results);
+    blocks_free();
+  } else {
+    // distribute work among N worker threads
+    worker_ranges = aligned_alloc(64, nthreads * sizeof(*worker_ranges));
+    file_results = calloc(nthreads, sizeof(*file_results));
+    if (!worker_ranges || !file_results) {
+      perror("malloc error");
+    }
+    if (!results || !worker_ranges || !file_results ||
+        distribute_chunks() != 0) {
+      free(results);
+      free(worker_ranges);
+      free(file_results);
+      file_results = NULL;
+      return input_error(b, start, fd);
+    }
+    for (unsigned int i = 0; i < nthreads; i++) {
+      atomic_init(&worker_ranges[i].range, 0);
+    }
+    start_workers(process_chunk);
+    wait_workers(results);
+    free(chunk_order);
+    free(worker_ranges);
+  }
+  if (fd > STDIN_FILENO) {
+    close(fd);
+  }
+
+  // the workers merged their results as they finished
+  // one of them returned the final result, unless one that had no memory
+  // for a result of its own left it waiting to be merged
+  struct Result *result = NULL;
+  for (unsigned int i = 0; i < nthreads; i++) {
+    if (results[i]) {
+      result = results[i];
+    }
+  }
+  free(results);
+  if (!result) {
+    result = atomic_exchange(&pending_result, NULL);
+  }
+
+  // after bad input (or running out of memory), what the workers have is
+  // incomplete: it's only gathered to be freed
+  int failed = atomic_load(&input_failed) || atomic_load(&merge_failed);
+  for (unsigned int i = 0; !failed && !per_file && i < ninputs; i++) {
+    process_tail(result, &inputs[i]);
+  }
+  failed = failed || out_of_memory;
+
+  // add everything before the checkpoint, then move the checkpoint up
+  if (previous && !failed && result_merge(result, previous)) {
+    previous->merged = result->merged;
+    result->merged = previous;
+  } else if (previous) {
+    result_free(previous);
+    failed = 1;
+  }
+  if (checkpoint && !failed &&
+      save_checkpoint(checkpoint, &sb, inputs[0].data, inputs[0].size,
+                      result) != 0) {
+    failed = 1;
+  }
+
+  // gather the results of every file from the workers, which only kept
+  // them apart from the combined result if there is more than one file
+  struct Result **input_results = NULL;
+  if (b->options.per_file) {
+    input_results = calloc(ninputs, sizeof(*input_results));
+    if (!input_results) {
+      perror("malloc error");
+      failed = 1;
+    }
+    if (!per_file && !failed) {
+      input_results[0] = new_result();
+      failed = !input_results[0] || !result_merge(input_results[0], result);
+    }
+    for (unsigned int i = 0; per_file && i < ninputs; i++) {
+      struct Result *r = NULL;
+      for (unsigned int w = 0; w < nthreads; w++) {
+        struct Result *own = file_results[w] ? file_results[w][i] : NULL;
+        if (!own) {
+          continue;
+        }
+        if (!r) {
+          r = own;
+        } else {
+          failed = failed || !result_merge(r, own);
+          result_free(own);
+        }
+      }
+      if (!r && !failed) {
+        r = new_result();
+        failed = !r;
+      }
+      if (!failed) {
+        process_tail(r, &inputs[i]);
+        failed = !result_merge(result, r);
+      }
+      if (input_results) {
+        input_results[i] = r;
+      } else if (r) {
+        result_free(r);
+      }
+    }
+    failed = failed || out_of_memory;
+  }
+  for (unsigned int w = 0; file_results && w < nthreads; w++) {
+    free(file_results[w]);
+  }
+  free(file_results);
+  file_results = NULL;
+
+  // report how much memory actually ended up on huge pages
+  if (huge_pages) {
+    size_t input = 0;
+    for (unsigned int i = 0; i < ninputs; i++) {
+      if (inputs[i].data) {
+        input += huge_kb(inputs[i].data, inputs[i].data + inputs[i].mapped);
+      }
+    }
+    size_t total = huge_kb(NULL, NULL);
+    fprintf(stderr,
+            "huge pages: %zu MB of the input, %zu MB of other memory "
+            "(hashmaps: MADV_HUGEPAGE %s)\n",
+            input >> 10, (total - input) >> 10,
+            atomic_load(&huge_pages_refused) ? "refused" : "accepted");
+  }
+
+  if (!failed && input_results && add_file_results(b, input_results) != 0) {
+    failed = 1;
+  }
+  if (!failed && add_result(b, result) != 0) {
+    if (input_results) {
+      drop_file_results(b);
+    }
+    failed = 1;
+  }
+  if (failed) {
+    for (unsigned int i = 0; input_results && i < ninputs; i++) {
+      if (input_results[i]) {
+        result_free(input_results[i]);
+      }
+    }
+    free(input_results);
+    if (result) {
+      result_free(result);
+    }
+    return input_error(b, start, -1);
+  }
+  free(input_results);
+  return 0;
+}
+
+void brc_set_memory(const struct brc_memory *memory) {
+  memory_limit = memory->limit;
+  huge_pages = memory->huge_pages;
+  table_hook_realloc = memory->realloc;
+  table_hook_free = memory->free;
+  table_hook_arena = memory->arena;
+}
+
+// brc_format passes the rank on to top_entries as is
+_Static_assert((int)BRC_RANK_MAX == RANK_MAX &&
+                   (int)BRC_RANK_MEAN == RANK_MEAN &&
+                   (int)BRC_RANK_MIN == RANK_MIN,
+               "brc_rank and Rank differ");
+
+struct brc *brc_new(const struct brc_options *options) {
+  if (options->threads > BRC_MAX_THREADS ||
+      options->cursors > BRC_MAX_CURSORS || options->by > BRC_RANK_MIN) {
+    errno = EINVAL;
+    return NULL;
+  }
+  for (size_t i = 0; i < options->npercentiles; i++) {
+    if (!(options->percentiles[i] >= 0 && options->percentiles[i] <= 100)) {
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  if ((options->first_row > 0 || options->last_row > 0) && !options->index) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (options->last_row > 0 && options->last_row < options->first_row) {
+    errno = EINVAL;
+    return NULL;
+  }
+  out_of_memory = 0;
+  struct brc *b = brc_alloc();
+  if (!b) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  b->options = *options;
+  if (options->nstations > 0) {
+    b->stations = station_set_new(options->stations, options->nstations);
+    if (!b->stations) {
+      brc_free(b);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+  if (options->npercentiles > 0) {
+    const size_t size = options->npercentiles * sizeof(*b->percentiles);
+    b->percentiles = malloc(size);
+    if (!b->percentiles) {
+      perror("malloc error");
+    }
+    if (!b->percentiles || !result_keep_histograms(b->result)) {
+      brc_free(b);
+      errno = ENOMEM;
+      return NULL;
+    }
+    memcpy(b->percentiles, options->percentiles, size);
+    b->options.percentiles = b->percentiles;
+  }
+  if (options->stddev && !result_keep_squares(b->result)) {
+    brc_free(b);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return b;
+}
+
+int brc_aggregate_files(struct brc *b, const char *const *paths, size_t n) {
+  out_of_memory = 0;
+
+  // remember where the files came from, for brc_changed
+  // (copied first, so that there's no running out of memory after)
+  char **sources =
+      realloc(b->sources, (b->nsources + n) * sizeof(*b->sources));
+  if (!sources) {
+    perror("realloc error");
+    return -1;
+  }
+  b->sources = sources;
+  size_t copied = 0;
+  for (; copied < n; copied++) {
+    sources[b->nsources + copied] = strdup(paths[copied]);
+    if (!sources[b->nsources + copied]) {
+      perror("malloc error");
+      break;
+    }
+  }
+
+  int ret = -1;
+  if (copied == n) {
+    pthread_once(&numa_once, numa_init);
+    pthread_mutex_lock(&aggregate_lock);
+    ret = aggregate_files(b, paths, n);
+    pthread_mutex_unlock(&aggregate_lock);
+  }
+  if (ret != 0) {
+    while (copied > 0) {
+      free(sources[b->nsources + --copied]);
+    }
+    return ret;
+  }
+  b->nsources += n;
+  return 0;
+}
+
+int brc_changed(const struct brc *b) {
+  // find the files again, as a directory or pattern may match others now
+  // (without memory for that, they count as changed)
+  out_of_memory = 0;
+  struct brc *now = brc_alloc();
+  if (!now) {
+    return 1;
+  }
+  int changed = 0;
+  for (size_t i = 0; i < b->nsources && !changed; i++) {
+    changed = add_inputs(now, b->sources[i]) != 0;
+  }
+  changed |= now->ninputs != b->ninputs;
+  for (unsigned int i = 0; i < b->ninputs && !changed; i++) {
+    const struct Input *in = &b->inputs[i];
+    struct stat st;
+    if (strcmp(in->path, "-") == 0) {
+      continue;
+    }
+    changed = strcmp(in->path, now->inputs[i].path) != 0 ||
+              stat(in->path, &st) != 0 || st.st_dev != in->st.st_dev ||
+              st.st_ino != in->st.st_ino || st.st_size != in->st.st_size ||
+              st.st_mtim.tv_sec != in->st.st_mtim.tv_sec ||
+              st.st_mtim.tv_nsec != in->st.st_mtim.tv_nsec;
+  }
+  brc_free(now);
+  return changed;
+}
+
+// returns whether every line of buf is a name, a ';' and a temperature like
+// -12.3, as the parser takes for granted, reporting the first that isn't
+static int valid_lines(const char *buf, size_t len) {
+  const char *end = buf + len;
+  size_t line = 1;
+  for (const char *s = buf; s < end; line++) {
+    const char *newline = memchr(s, '\n', (size_t)(end - s));
+    const char *eol = newline ? newline : end;
+    const char *semicolon = memchr(s, ';', (size_t)(eol - s));
+    int temperature;
+    if (!semicolon ||
+        !parse_tenths(semicolon + 1, (size_t)(eol - semicolon - 1),
+                      &temperature)) {
+      fprintf(stderr, "invalid measurement on line %zu\n", line);
+      return 0;
+    }
+    s = eol + 1;
+  }
+  return 1;
+}
+
+int brc_aggregate_buffer(struct brc *b, const char *buf, size_t len) {
+  const unsigned int cursors = b->options.cursors ? b->options.cursors : 2;
+  out_of_memory = 0;
+
+  // buf comes from the caller rather than a file we chose to trust,
+  // so it's checked as a whole before any of it is added
+  if (!valid_lines(buf, len)) {
+    return -1;
+  }
+
+  // the lines are added to a result of their own, which is merged in as a
+  // whole, so that running out of memory halfway leaves b as it is
+  if (!b->scratch) {
+    struct Result *scratch = result_new();
+    if (!scratch || (b->result->hist && !result_keep_histograms(scratch)) ||
+        (b->result->squares && !result_keep_squares(scratch))) {
+      if (scratch) {
+        result_free(scratch);
+      }
+      return -1;
+    }
+    b->scratch = scratch;
+  }
+
+  // the parser reads a little past the end of every line
+  // so the lines near the end of buf are parsed from a padded copy
+  const char *tail = buf;
+  // (buf may be NULL if len is 0, which GCC can't rule out on its own)
+  if (buf && len > BUFFER_SLACK) {
+    const char *last = memrchr(buf, '\n', len - BUFFER_SLACK);
+    tail = last ? last + 1 : buf;
+  }
+  size_t n = (size_t)(buf + len - tail);
+  if (n + 1 + MMAP_PADDING > b->tail_capacity) {
+    char *copy = malloc(n + 1 + MMAP_PADDING);
+    if (!copy) {
+      perror("malloc error");
+      return -1;
+    }
+    free(b->tail);
+    b->tail = copy;
+    b->tail_capacity = n + 1 + MMAP_PADDING;
+  }
+
+  if (tail > buf) {
+    process_range(b->scratch, buf, tail, cursors, b->stations);
+  }
+  memcpy(b->tail, tail, n);
+  if (n > 0 && b->tail[n - 1] != '\n') {
+    b->tail[n++] = '\n';
+  }
+  memset(&b->tail[n], 0, MMAP_PADDING);
+  if (n > 0) {
+    process_range(b->scratch, b->tail, &b->tail[n], 1, b->stations);
+  }
+
+  const int merged = !out_of_memory && result_merge(b->result, b->scratch);
+  result_clear(b->scratch);
+  return merged ? 0 : -1;
+}
+
+int brc_merge(struct brc *dest, const struct brc *src) {
+  out_of_memory = 0;
+  return result_merge(dest->result, src->result) ? 0 : -1;
+}
+
+size_t brc_stations(const struct brc *b) { return b->result->n; }
+
+void brc_station(const struct brc *b, size_t i, struct brc_station *station) {
+  const struct Group *g = &b->result->groups[i];
+  station->name = group_key(b->result, (unsigned int)i);
+  station->len = b->result->keys[i].len;
+  station->count = g->count;
+  station->sum = g->sum;
+  station->min = g->min;
+  station->max = g->max;
+  station->sum_squares = b->result->squares ? b->result->squares[i] : 0;
+}
+
+size_t brc_files(const struct brc *b) { return b->nfiles; }
+
+const struct brc *brc_file(const struct brc *b, size_t i, const char **path) {
+  *path = b->files[i]->path;
+  return b->files[i];
+}
+
+// gives back the pages of buf, a mapping of size bytes, past its first len
+static void trim_output(char *buf, size_t size, size_t len) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t used = (len + page - 1) / page * page;
+  if (used < size) {
+    munmap(buf + used, size - used);
+  }
+}
+
+// a buffer of known size, written to through a FILE
+struct Output {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+static ssize_t write_output(void *cookie, const char *buf, size_t n) {
+  struct Output *out = cookie;
+  if (n > out->size - out->len) {
+    errno = ENOSPC;
+    return -1;
+  }
+  memcpy(out->buf + out->len, buf, n);
+  out->len += n;
+  return (ssize_t)n;
+}
+
+char *brc_format(const struct brc *b, enum brc_format format, size_t *len) {
+  const struct Result *result = b->result;
+  if (format == BRC_FORMAT_TEXT) {
+    unsigned int n = result->n;
+    struct Entry *entries =
+        b->options.top > 0
+            ? top_entries(result, b->options.top, (enum Rank)b->options.by, &n)
+            : sorted_entries(result);
+    if (!entries) {
+      return NULL;
+    }
+    char *buf = format_results(result, entries, n, b->options.percentiles,
+                               b->options.npercentiles, len);
+    if (!buf) {
+      free(entries);
+      return NULL;
+    }
+    trim_output(buf,
+                format_size(entries, n,
+                            b->options.npercentiles + (result->squares != NULL)),
+                *len);
+    free(entries);
+    return buf;
+  }
+
+  // partial aggregates take a known number of bytes
+  size_t size = sizeof(PARTIAL_MAGIC) - 1 + sizeof(uint64_t);
+  for (unsigned int i = 0; i < result->n; i++) {
+    size += sizeof(uint32_t) + result->keys[i].len + GROUP_DISK_SIZE;
+  }
+  char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    perror("mmap error");
+    return NULL;
+  }
+  // fmemopen would reserve the last byte for a terminating NUL
+  struct Output out = {buf, 0, size};
+  cookie_io_functions_t io = {.write = write_output};
+  FILE *f = fopencookie(&out, "w", io);
+  if (!f) {
+    perror("fopencookie error");
+    munmap(buf, size);
+    return NULL;
+  }
+  write_partial(f, result);
+  if (fclose(f) != 0 || out.len != size) {
+    perror("write error");
+    munmap(buf, size);
+    return NULL;
+  }
+  *len = size;
+  return buf;
+}
+
+void brc_free_output(char *buf, size_t len) { munmap(buf, len); }
+
+void brc_free(struct brc *b) {
+  for (size_t i = 0; i < b->nfiles; i++) {
+    brc_free(b->files[i]);
+  }
+  free(b->files);
+  close_inputs(b, 0);
+  free(b->inputs);
+  for (size_t i = 0; i < b->nsources; i++) {
+    free(b->sources[i]);
+  }
+  free(b->sources);
+  free(b->tail);
+  if (b->stations) {
+    station_set_free(b->stations);
+  }
+  free(b->percentiles);
+  if (b->scratch) {
+    result_free(b->scratch);
+  }
+  result_free(b->result);
+  free(b);
+}
@@ -0,0 +1,155 @@
+// libbrc: the aggregation engine behind analyze, for use in other programs
+//
+// A struct brc holds per-station aggregates (count, sum, min and max of the
+// temperatures, in tenths of a degree) and grows as files or buffers of
+// measurements are added to it. Problems with the input, like files that
+// can't be opened or lines that are too long, are reported on stderr and
+// returned as -1, and so is running out of memory (or past the memory
+// limit): the struct brc stays as it was before the call, and can be used
+// or freed as usual.
+
+#ifndef BRC_H
+#define BRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Upper limits for brc_options
+#define BRC_MAX_THREADS 4096
+#define BRC_MAX_CURSORS 16
+
+enum brc_engine {
+  BRC_ENGINE_MMAP,
+  BRC_ENGINE_URING,
+};
+
+enum brc_rank {
+  BRC_RANK_MAX,
+  BRC_RANK_MEAN,
+  BRC_RANK_MIN,
+};
+
+// How files are aggregated, all zero for the defaults
+struct brc_options {
+  // worker threads, the CPUs available to us if 0
+  unsigned int threads;
+  // lines each thread processes in lockstep, 2 if 0
+  unsigned int cursors;
+  // how regular files are read (pipes are always streamed)
+  enum brc_engine engine;
+  // pin workers to CPUs, 2 to use one hardware thread per core
+  int pin;
+  // keep the results of every file apart as well, see brc_file
+  int per_file;
+  // keep the aggregates of a single, growing file in this file
+  // and only parse what was appended since
+  const char *checkpoint;
+  // only aggregate these stations, all of them if nstations is 0
+  const char *const *stations;
+  size_t nstations;
+  // render only the top stations with the highest max, mean or min as text,
+  // highest first, all of them in order of name if 0
+  // (partial aggregates always hold every station, so they can be merged)
+  unsigned int top;
+  enum brc_rank by;
+  // keep a histogram of every station's temperatures, and render these
+  // percentiles (in [0, 100]) after the max as text
+  const double *percentiles;
+  size_t npercentiles;
+  // keep the sum of squares of every station's temperatures, and render
+  // the standard deviation after the max (before any percentiles) as text
+  int stddev;
+  // aggregate the (single, text) file with the help of this index of it,
+  // written by brc-index: only the blocks at the edges of the row range
+  // are parsed, and blocks without any of the stations are skipped
+  const char *index;
+  // with an index, only aggregate rows [first_row, last_row) of the file,
+  // counted from 0, up to its end if last_row is 0
+  uint64_t first_row;
+  uint64_t last_row;
+};
+
+// Memory used for the hashmaps, by all of the process
+struct brc_memory {
+  // fail instead of growing the hashmaps past this many bytes, 0 for no limit
+  size_t limit;
+  // back the hashmaps and file mappings with huge pages where possible
+  int huge_pages;
+  // if set, hashmap memory comes from these instead of malloc,
+  // both get arena as their first argument
+  void *(*realloc)(void *arena, void *ptr, size_t old_size, size_t size);
+  void (*free)(void *arena, void *ptr, size_t size);
+  void *arena;
+};
+
+// Aggregates of a single station
+struct brc_station {
+  const char *name;
+  size_t len;
+  uint64_t count;
+  int64_t sum;
+  int min;
+  int max;
+  // sum of the squares of the temperatures, 0 unless kept (with stddev)
+  uint64_t sum_squares;
+};
+
+enum brc_format {
+  // {name=min/mean/max, ...} sorted by name, like analyze prints it
+  BRC_FORMAT_TEXT,
+  // partial aggregates, for brc-merge
+  BRC_FORMAT_PARTIAL,
+};
+
+struct brc;
+
+// sets up hashmap memory, before any struct brc is created
+void brc_set_memory(const struct brc_memory *memory);
+
+// returns an empty set of aggregates, or NULL (with errno set to EINVAL or
+// ENOMEM) if the options are invalid or there's no memory for it
+struct brc *brc_new(const struct brc_options *options);
+
+// aggregates the given files on a pool of worker threads
+// paths may be directories (all regular files in them), patterns like
+// "data/*.txt", or "-" for stdin; text and columnar files can be mixed
+// only one call aggregates files at a time, others wait for it
+// the files stay mapped until brc_free, the worker threads stay parked
+// until the process exits
+int brc_aggregate_files(struct brc *b, const char *const *paths, size_t n);
+
+// returns 1 if the paths given to brc_aggregate_files now lead to other files,
+// or any of the files changed (inode, size or modification time) since
+// stdin never counts as changed, files count as changed if there's no
+// memory to look
+int brc_changed(const struct brc *b);
+
+// aggregates the lines in buf on the calling thread
+// a missing newline at the end is tolerated, lines can't be split across calls
+// returns -1, adding none of them, if any line isn't like "name;-12.3"
+int brc_aggregate_buffer(struct brc *b, const char *buf, size_t len);
+
+// adds the aggregates of src to dest
+// (percentiles only stay exact if both were made with them)
+// returns -1, leaving dest as it is, if a station would get too many rows
+// (or there's no memory for the stations dest lacks)
+int brc_merge(struct brc *dest, const struct brc *src);
+
+// returns the number of stations, which are numbered in no particular order
+size_t brc_stations(const struct brc *b);
+void brc_station(const struct brc *b, size_t i, struct brc_station *station);
+
+// returns the number of files with results of their own (with per_file)
+// and those results, along with the file's path
+size_t brc_files(const struct brc *b);
+const struct brc *brc_file(const struct brc *b, size_t i, const char **path);
+
+// renders the aggregates into a buffer of their own, which stays valid
+// (and may be spliced into a pipe) until released with brc_free_output
+// returns NULL if there's no memory for it
+char *brc_format(const struct brc *b, enum brc_format format, size_t *len);
+void brc_free_output(char *buf, size_t len);
+
+void brc_free(struct brc *b);
+
+#endif
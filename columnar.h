@@ -0,0 +1,44 @@
+// Columnar measurement files, as written by brc-convert and read by analyze
+//
+// Every station is replaced by a 16-bit id, every temperature by its value
+// in tenths as an int16, so a row takes 4 bytes instead of about 14:
+//
+//   header, padded to COLUMNAR_DATA_OFFSET
+//   blocks of block_rows rows: block_rows ids, then block_rows temperatures
+//   (the last block holds the remaining rows, ids then temperatures)
+//   dictionary: for every station, in order of id, its name's length (u32)
+//   followed by the name
+//
+// All numbers are in native byte order
+
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <stdint.h>
+
+#define COLUMNAR_MAGIC "1brccol1"
+
+// Rows start at a page boundary, the header fits in front of them
+#define COLUMNAR_DATA_OFFSET 4096
+
+// Rows per block, so that a block is as big as one of analyze's chunks
+#define COLUMNAR_BLOCK_ROWS ((1 << 20) / 2)
+
+// Station ids are 16 bits
+#define COLUMNAR_MAX_STATIONS (1 << 16)
+
+struct ColumnarHeader {
+  char magic[8];
+  uint64_t rows;
+  uint64_t block_rows;
+  uint64_t stations;
+  uint64_t dictionary;
+};
+
+// returns the offset of block i in a file with the given block size
+static inline uint64_t columnar_block(const struct ColumnarHeader *h,
+                                      uint64_t i) {
+  return COLUMNAR_DATA_OFFSET + i * h->block_rows * 4;
+}
+
+#endif
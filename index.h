@@ -0,0 +1,79 @@
+// Sidecar indexes of text measurement files, as written by brc-index and
+// read by analyze --index
+//
+// The file is cut into blocks of block_size bytes, and every line belongs
+// to the block it starts in. For every block, the index records where its
+// first line starts, its rows, which stations appear in it and their
+// aggregates, so that a query only has to parse the blocks at the edges of
+// its row range:
+//
+//   header
+//   blocks: an IndexBlock for every block
+//   bitmaps: for every block, a bit for every station id, in 64-bit words
+//   groups: for every block, an IndexGroup for every station in its bitmap,
+//   in order of id
+//   dictionary: for every station, in order of id, its name's length (u32)
+//   followed by the name
+//
+// The header identifies the text file by its device, inode, size and
+// modification time; an index is out of date as soon as any of them change.
+// All numbers are in native byte order
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+
+#define INDEX_MAGIC "1brcidx1"
+
+// Bytes per block, as big as one of analyze's chunks
+#define INDEX_BLOCK_SIZE ((uint64_t)(1 << 20) * 2)
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t block_size;
+  uint64_t blocks;
+  uint64_t rows;
+  uint64_t stations;
+  uint64_t groups;
+  uint64_t dictionary;
+};
+
+// offset is where the block's first line starts (where the next one does,
+// if it has no rows), groups the index of its first IndexGroup
+struct IndexBlock {
+  uint64_t offset;
+  uint64_t first_row;
+  uint64_t rows;
+  uint64_t groups;
+};
+
+// Aggregates of a station over a block, in tenths of a degree
+struct IndexGroup {
+  int64_t sum;
+  uint32_t count;
+  int16_t min;
+  int16_t max;
+};
+
+// returns the number of 64-bit words in the bitmap of a block
+static inline uint64_t index_words(const struct IndexHeader *h) {
+  return (h->stations + 63) / 64;
+}
+
+// returns the offset of the bitmaps, which follow the blocks
+static inline uint64_t index_bitmaps(const struct IndexHeader *h) {
+  return sizeof(*h) + h->blocks * sizeof(struct IndexBlock);
+}
+
+// returns the offset of the groups, which follow the bitmaps
+static inline uint64_t index_groups(const struct IndexHeader *h) {
+  return index_bitmaps(h) + h->blocks * index_words(h) * sizeof(uint64_t);
+}
+
+#endif
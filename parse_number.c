@@ -0,0 +1,128 @@
+// Benchmark comparing the branching temperature parser from 7.c
+// with the branch-free SWAR parser used in brc.c (both in parse_number.h)
+// on a buffer of random temperatures in the measurements.txt format
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "parse_number.h"
+
+#define N 50000000
+
+// opens a counter for branch misses of the calling thread
+// returns -1 if the kernel doesn't let us (e.g. perf_event_paranoid or no PMU)
+static int branch_miss_counter(void) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+// sum all temperatures in the buffer using either parser
+static int64_t sum_branching(const char *s, const char *end) {
+  int64_t sum = 0;
+  while (s < end) {
+    int temperature;
+    s = parse_number_branching(&temperature, s);
+    sum += temperature;
+  }
+  return sum;
+}
+
+#ifdef USE_SWAR
+static int64_t sum_swar(const char *s, const char *end) {
+  int64_t sum = 0;
+  while (s < end) {
+    int temperature;
+    s = parse_number_swar(&temperature, s);
+    sum += temperature;
+  }
+  return sum;
+}
+#endif
+
+static void run(const char *name,
+                int64_t (*sum_function)(const char *, const char *),
+                const char *buf, const char *end) {
+  int fd = branch_miss_counter();
+  struct timespec start, finish;
+
+#ifdef __linux__
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int64_t sum = sum_function(buf, end);
+
+  clock_gettime(CLOCK_MONOTONIC, &finish);
+
+  long long misses = -1;
+#ifdef __linux__
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = -1;
+    }
+    close(fd);
+  }
+#endif
+
+  double elapsed = (double)(finish.tv_sec - start.tv_sec);
+  elapsed += (double)(finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+  printf("%-10s %6.2f ns/row", name, elapsed * 1e9 / N);
+  if (misses >= 0) {
+    printf("    %.3f branch misses/row", (double)misses / N);
+  } else {
+    printf("    branch misses n/a");
+  }
+  printf("\t%" PRId64 "\n", sum);
+}
+
+int main(void) {
+  // every row is "<temperature>\n" with a random value in [-99.9, 99.9]
+  // plus some padding so the SWAR parser can read a full word at the end
+  char *buf = malloc((size_t)N * 6 + 8);
+  if (!buf) {
+    perror("malloc error");
+    return EXIT_FAILURE;
+  }
+
+  char *end = buf;
+  for (unsigned int i = 0; i < N; i++) {
+    int t = rand() % 1999 - 999;
+    end += sprintf(end, "%s%d.%d\n", t < 0 ? "-" : "", abs(t) / 10,
+                   abs(t) % 10);
+  }
+  memset(end, 0, 8);
+
+  run("branching", sum_branching, buf, end);
+#ifdef USE_SWAR
+  run("swar", sum_swar, buf, end);
+#endif
+
+  free(buf);
+  return EXIT_SUCCESS;
+}
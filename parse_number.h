@@ -0,0 +1,75 @@
+// Temperature parsing, shared by brc.c and the parse_number benchmark
+//
+// Temperatures are always one of -99.9 to 99.9 with a single decimal,
+// followed by a newline, so they are parsed as integers in tenths
+
+#ifndef PARSE_NUMBER_H
+#define PARSE_NUMBER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// The SWAR number parser (and brc.c's key scanner) rely on little-endian
+// byte order, other targets use the plain byte-at-a-time loops
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && \
+    !defined(NOSWAR)
+#define USE_SWAR 1
+#endif
+
+// parses a floating point number as an integer
+// this is only possible because we know our data file has only a single decimal
+static inline const char *parse_number_branching(int *dest, const char *s) {
+  // parse sign
+  int mod = 1;
+  if (*s == '-') {
+    mod = -1;
+    s++;
+  }
+
+  if (s[1] == '.') {
+    *dest = ((s[0] * 10) + s[2] - ('0' * 11)) * mod;
+    return s + 4;
+  }
+
+  *dest = (s[0] * 100 + s[1] * 10 + s[3] - ('0' * 111)) * mod;
+  return s + 5;
+}
+
+#ifdef USE_SWAR
+// the number is loaded as a single word and decoded without any branches:
+// the '.' is the only byte in the number with bit 4 cleared (digits are
+// 0x30-0x39) so its position tells us how many integer digits there are,
+// after which the digits are shifted into fixed places and combined
+// into X*100 + Y*10 + Z with a single multiplication
+// reads 8 bytes from s, so there must be padding after the last number
+static inline const char *parse_number_swar(int *dest, const char *s) {
+  uint64_t word;
+  memcpy(&word, s, sizeof(word));
+
+  // bit position of the '.' (12, 20 or 28)
+  unsigned int dot = (unsigned int)__builtin_ctzll(~word & 0x10101000);
+
+  // all ones if the number is negative, zero otherwise
+  int64_t sign = (int64_t)(~word << 59) >> 63;
+
+  // clear the '-' (if any) and line up the digits as 0x0Z000Y0X00
+  uint64_t digits = ((word & ~((uint64_t)sign & 0xFF)) << (28 - dot)) &
+                    0x0F000F0F00ULL;
+  int64_t value = (int64_t)(((digits * 0x640a0001) >> 32) & 0x3FF);
+
+  *dest = (int)((value ^ sign) - sign);
+  return s + (dot >> 3) + 3;
+}
+#endif
+
+// parses the temperature at s into *dest (in tenths)
+// returns a pointer past its newline
+static inline const char *parse_number(int *dest, const char *s) {
+#ifdef USE_SWAR
+  return parse_number_swar(dest, s);
+#else
+  return parse_number_branching(dest, s);
+#endif
+}
+
+#endif
@@ -0,0 +1,49 @@
+#!/usr/bin/bash
+# Feeds brc-merge crafted files of partial aggregates (see aggregate.h):
+# a well-formed one has to merge, malformed ones have to be rejected
+# with an error rather than crash it
+
+make -s bin/brc-merge || exit 1
+dir=$(mktemp -d)
+trap 'rm -r "$dir"' EXIT
+failed=0
+
+# writes a partial file with a single group: key, sum, count, min, max
+partial() {
+    perl -e 'print pack("a8 Q< L< a* q< Q< s< s<", "1brcagg1", 1,
+                        length($ARGV[0]), @ARGV)' "$@" > "$dir/in.agg"
+}
+
+expect() {
+    local want=$1 name=$2
+    ./bin/brc-merge "$dir/in.agg" > "$dir/out.txt" 2>/dev/null
+    local rc=$?
+    if [ "$want" = ok ] && [ $rc -ne 0 ]; then
+        echo "FAIL $name: rc=$rc"; failed=1
+    elif [ "$want" = reject ] && [ $rc -ne 1 ]; then
+        echo "FAIL $name: rc=$rc, want 1"; failed=1
+    else
+        echo "ok   $name"
+    fi
+}
+
+partial Oslo 30 3 5 15
+expect ok "well-formed group"
+if [ "$(cat "$dir/out.txt")" != "{Oslo=0.5/1.0/1.5}" ]; then
+    echo "FAIL well-formed group: $(cat "$dir/out.txt")"; failed=1
+fi
+
+partial "$(printf 'x%.0s' {1..4066})" 4000000000000000000 1 0 0
+expect reject "sum above max * count"
+partial Oslo -100 2 0 10
+expect reject "sum below min * count"
+partial Oslo 0 0 0 0
+expect reject "count of 0"
+partial Oslo 0 4294967296 0 0
+expect reject "count past 32 bits"
+partial Oslo 10 1 10 5
+expect reject "min above max"
+perl -e 'print pack("a8 Q< L<", "1brcagg1", 1, 0xFFFFFFFF)' > "$dir/in.agg"
+expect reject "key longer than the file"
+
+exit $failed